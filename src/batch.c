@@ -0,0 +1,432 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "batch.h"
+
+#define BATCH_SLOTS_PER_JOB 2
+
+// Ring slot of the batch pipeline. The sequence tells which stage owns the slot for record r = sequence - stage,
+// where stage is 0 for the reader (free), 1 for the encoders (read) and 2 for the writer (encoded).
+// Stages hand the slot over under the pipeline lock and sleep on the slot until it reaches theirs, so an idle
+// pipeline waiting for input takes no CPU.
+typedef struct BatchSlot BatchSlot;
+struct BatchSlot
+{
+    int64_t sequence;       // guarded by the pipeline lock
+    pthread_cond_t changed; // signalled when the sequence changes or the reader is done
+    char text[MAX_TEXT_LEN];
+    int32_t textLen;
+    QROptions options;
+    QR qr;
+};
+
+typedef struct BatchPipeline BatchPipeline;
+struct BatchPipeline
+{
+    pthread_mutex_t lock;
+    BatchSlot *slots;
+    int32_t slotsCount;
+    _Atomic int64_t nextEncodeIndex; // next record claimed by an encoder
+    int64_t recordsCount;            // INT64_MAX until the reader is done, guarded by the lock
+    BatchOptions *batch;
+};
+
+global BatchSlot BATCH_SLOTS[BATCH_MAX_JOBS * BATCH_SLOTS_PER_JOB];
+
+void
+batch_reader_init(BatchReader *reader, FILE *file, BatchFraming framing)
+{
+    reader->file = file;
+    reader->framing = framing;
+    reader->recordsCount = 0;
+    reader->start = 0;
+    reader->end = 0;
+    reader->isEof = false;
+}
+
+// Moves the unread bytes to the front and reads more after them. Returns false if nothing was read.
+internal bool
+fill_buffer(BatchReader *reader)
+{
+    if (reader->start > 0) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->isEof || reader->end == BATCH_BUFFER_SIZE) {
+        return false;
+    }
+    size_t readCount = fread(reader->buffer + reader->end, 1, BATCH_BUFFER_SIZE - reader->end, reader->file);
+    if (ferror(reader->file) != 0) {
+        fprintf(stderr, "Failed to read records: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (readCount == 0) {
+        reader->isEof = true;
+        return false;
+    }
+    reader->end += (int32_t)readCount;
+    return true;
+}
+
+// Points record at the next record in the reader buffer, valid until the next call. Returns false at the end.
+bool
+batch_read_record(BatchReader *reader, char **record, int32_t *recordLen)
+{
+    int64_t recordIndex = reader->recordsCount;
+
+    if (reader->framing == BF_LENGTH) {
+        while (reader->end - reader->start < 4) {
+            if (!fill_buffer(reader)) {
+                if (reader->end == reader->start) {
+                    return false;
+                }
+                fprintf(stderr, "Record %" PRId64 " has a truncated length\n", recordIndex);
+                exit(1);
+            }
+        }
+        uint8_t *prefix = (uint8_t *)reader->buffer + reader->start;
+        uint32_t length = ((uint32_t)prefix[0] << 24) | ((uint32_t)prefix[1] << 16) | ((uint32_t)prefix[2] << 8) | prefix[3];
+        if (length > BATCH_MAX_RECORD_LEN) {
+            fprintf(stderr, "Record %" PRId64 " exceeds the maximum length of %d bytes\n", recordIndex, BATCH_MAX_RECORD_LEN);
+            exit(1);
+        }
+        while (reader->end - reader->start < 4 + (int32_t)length) {
+            if (!fill_buffer(reader)) {
+                fprintf(stderr, "Record %" PRId64 " is truncated\n", recordIndex);
+                exit(1);
+            }
+        }
+        *record = reader->buffer + reader->start + 4;
+        *recordLen = (int32_t)length;
+        reader->start += 4 + (int32_t)length;
+        reader->recordsCount++;
+        return true;
+    }
+
+    char delimiter = (reader->framing == BF_LINE) ? '\n' : '\0';
+    int32_t searchedCount = 0;
+    for (;;) {
+        char *from = reader->buffer + reader->start;
+        char *found = memchr(from + searchedCount, delimiter, reader->end - reader->start - searchedCount);
+        if (found != NULL) {
+            *record = from;
+            *recordLen = (int32_t)(found - from);
+            reader->start += *recordLen + 1;
+            break;
+        }
+        searchedCount = reader->end - reader->start;
+        if (searchedCount > BATCH_MAX_RECORD_LEN) {
+            fprintf(stderr, "Record %" PRId64 " exceeds the maximum length of %d bytes\n", recordIndex, BATCH_MAX_RECORD_LEN);
+            exit(1);
+        }
+        if (!fill_buffer(reader)) {
+            if (reader->end == reader->start) {
+                return false;
+            }
+            // The last record may miss its delimiter.
+            *record = reader->buffer + reader->start;
+            *recordLen = reader->end - reader->start;
+            reader->start = reader->end;
+            break;
+        }
+    }
+    reader->recordsCount++;
+    return true;
+}
+
+internal void
+parse_record_option(char *option, int32_t optionLen, int64_t recordIndex, QROptions *options)
+{
+    char value[BATCH_MAX_OPTIONS_LEN + 1] = {};
+    if (optionLen < 2 || option[1] != '=') {
+        fprintf(stderr, "Record %" PRId64 " has an invalid option: %.*s\n", recordIndex, optionLen, option);
+        exit(1);
+    }
+    memcpy(value, option + 2, optionLen - 2);
+
+    char *valueEnd = NULL;
+    long number = strtol(value, &valueEnd, 10);
+    bool isNumber = (value[0] != '\0') && (*valueEnd == '\0');
+    switch (option[0]) {
+        case 'l': {
+            if (!isNumber || number < ECL_LOW || number > ECL_HIGH) {
+                fprintf(stderr, "Record %" PRId64 " has an invalid error correction level: %s\n", recordIndex, value);
+                exit(1);
+            }
+            options->forcedLevel = (ErrorCorrectionLevel)number;
+        } break;
+        case 'v': {
+            if (!isNumber || number - 1 < MIN_VERSION || number - 1 > MAX_VERSION) {
+                fprintf(stderr, "Record %" PRId64 " has an invalid version: %s\n", recordIndex, value);
+                exit(1);
+            }
+            options->forcedVersion = (int32_t)number - 1;
+        } break;
+        case 'm': {
+            if (!isNumber || number < MIN_MASK || number > MAX_MASK) {
+                fprintf(stderr, "Record %" PRId64 " has an invalid mask: %s\n", recordIndex, value);
+                exit(1);
+            }
+            options->forcedMask = (int32_t)number;
+        } break;
+        case 'o': {
+            OutputFormat outputFormat = 0;
+            while (outputFormat < OF_COUNT && strcmp(value, OutputFormatNames[outputFormat]) != 0) {
+                outputFormat++;
+            }
+            if (outputFormat == OF_COUNT) {
+                fprintf(stderr, "Record %" PRId64 " has an invalid output format: %s\n", recordIndex, value);
+                exit(1);
+            }
+            options->render.format = outputFormat;
+        } break;
+        case 'x': {
+            if (!isNumber || number < MIN_SCALE || number > MAX_SCALE) {
+                fprintf(stderr, "Record %" PRId64 " has an invalid scale: %s\n", recordIndex, value);
+                exit(1);
+            }
+            options->render.scale = (int32_t)number;
+        } break;
+        case 'q': {
+            if (!isNumber || number < 0 || number > MAX_QUIET_ZONE) {
+                fprintf(stderr, "Record %" PRId64 " has an invalid quiet zone: %s\n", recordIndex, value);
+                exit(1);
+            }
+            options->render.quietZone = (int32_t)number;
+        } break;
+        default: {
+            fprintf(stderr, "Record %" PRId64 " has an unknown option: %.*s\n", recordIndex, optionLen, option);
+            exit(1);
+        }
+    }
+}
+
+// Applies the per-record options on top of the ones already in options and points text at the rest of the record.
+void
+batch_parse_record(char *record, int32_t recordLen, bool hasRecordOptions, int64_t recordIndex, QROptions *options,
+                   char **recordText, int32_t *recordTextLen)
+{
+    char *text = record;
+    int32_t textLen = recordLen;
+    if (hasRecordOptions) {
+        char *tab = memchr(record, '\t', MIN(recordLen, BATCH_MAX_OPTIONS_LEN + 1));
+        if (tab == NULL) {
+            fprintf(stderr, "Record %" PRId64 " is missing the tab after its options\n", recordIndex);
+            exit(1);
+        }
+        for (char *option = record; option < tab;) {
+            char *comma = memchr(option, ',', tab - option);
+            char *optionEnd = (comma != NULL) ? comma : tab;
+            parse_record_option(option, (int32_t)(optionEnd - option), recordIndex, options);
+            option = optionEnd + 1;
+        }
+        text = tab + 1;
+        textLen = recordLen - (int32_t)(text - record);
+    }
+
+    if (textLen == 0) {
+        fprintf(stderr, "Record %" PRId64 " is empty\n", recordIndex);
+        exit(1);
+    }
+    if (textLen > MAX_TEXT_LEN) {
+        fprintf(stderr, "Record %" PRId64 " exceeds the maximum length of %d characters\n", recordIndex, MAX_TEXT_LEN);
+        exit(1);
+    }
+    *recordText = text;
+    *recordTextLen = textLen;
+}
+
+internal void
+copy_options(QROptions *options, QROptions *defaults)
+{
+    options->forcedLevel = defaults->forcedLevel;
+    options->forcedVersion = defaults->forcedVersion;
+    options->forcedMask = defaults->forcedMask;
+    options->maskSearch = defaults->maskSearch;
+    options->render = defaults->render;
+    options->isDebug = defaults->isDebug;
+}
+
+internal void
+encode_record(const char *text, int32_t textLen, QROptions *options, BatchOptions *batch, QRWorkspace *workspace,
+              int64_t recordIndex, QR *qr)
+{
+    QRStatus status = (batch->profile != NULL) ? qr_profile_encode(batch->profile, text, textLen, workspace, qr)
+                                               : qr_cache_encode(batch->cache, text, textLen, options, workspace, qr);
+    if (status != QR_OK) {
+        fprintf(stderr, "Failed to encode record %" PRId64 ": %s\n", recordIndex, qr_status_message(status));
+        exit(1);
+    }
+}
+
+// Waits until the slot of the record reaches the stage. Returns false if the record does not exist.
+internal bool
+wait_for_stage(BatchPipeline *pipeline, int64_t recordIndex, int64_t stage)
+{
+    BatchSlot *slot = &pipeline->slots[recordIndex % pipeline->slotsCount];
+    pthread_mutex_lock(&pipeline->lock);
+    bool isReached = (slot->sequence == recordIndex + stage);
+    while (!isReached && recordIndex < pipeline->recordsCount) {
+        pthread_cond_wait(&slot->changed, &pipeline->lock);
+        isReached = (slot->sequence == recordIndex + stage);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return isReached;
+}
+
+// Hands the slot over to the stage waiting for the sequence.
+internal void
+hand_over(BatchPipeline *pipeline, BatchSlot *slot, int64_t sequence)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    slot->sequence = sequence;
+    pthread_cond_broadcast(&slot->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+internal void *
+encode_records(void *arg)
+{
+    BatchPipeline *pipeline = arg;
+    QRWorkspace workspace;
+    for (;;) {
+        int64_t recordIndex = atomic_fetch_add(&pipeline->nextEncodeIndex, 1);
+        if (!wait_for_stage(pipeline, recordIndex, 1)) {
+            return NULL;
+        }
+        BatchSlot *slot = &pipeline->slots[recordIndex % pipeline->slotsCount];
+        encode_record(slot->text, slot->textLen, &slot->options, pipeline->batch, &workspace, recordIndex, &slot->qr);
+        hand_over(pipeline, slot, recordIndex + 2);
+    }
+}
+
+internal void *
+write_records(void *arg)
+{
+    BatchPipeline *pipeline = arg;
+    BatchOptions *batch = pipeline->batch;
+    for (int64_t recordIndex = 0; wait_for_stage(pipeline, recordIndex, 2); recordIndex++) {
+        BatchSlot *slot = &pipeline->slots[recordIndex % pipeline->slotsCount];
+        if (recordIndex > 0) {
+            fwrite(batch->separator, 1, batch->separatorLen, stdout);
+        }
+        qr_print(stdout, &slot->qr, &slot->options.render);
+        // Free the slot for the record that comes a whole ring later.
+        hand_over(pipeline, slot, recordIndex + pipeline->slotsCount);
+    }
+    return NULL;
+}
+
+// Reads records on the calling thread while the encoders and the writer run on their own.
+internal void
+run_pipeline(QROptions *defaults, BatchOptions *batch, BatchReader *reader)
+{
+    BatchPipeline pipeline = {};
+    pipeline.slots = BATCH_SLOTS;
+    pipeline.slotsCount = batch->jobsCount * BATCH_SLOTS_PER_JOB;
+    pipeline.batch = batch;
+    pthread_mutex_init(&pipeline.lock, NULL);
+    atomic_init(&pipeline.nextEncodeIndex, 0);
+    pipeline.recordsCount = INT64_MAX;
+    for (int32_t i = 0; i < pipeline.slotsCount; i++) {
+        pipeline.slots[i].sequence = i;
+        pthread_cond_init(&pipeline.slots[i].changed, NULL);
+    }
+
+    pthread_t writer;
+    pthread_t encoders[BATCH_MAX_JOBS];
+    if (pthread_create(&writer, NULL, write_records, &pipeline) != 0) {
+        fprintf(stderr, "Failed to start the batch writer\n");
+        exit(1);
+    }
+    for (int32_t i = 0; i < batch->jobsCount; i++) {
+        if (pthread_create(&encoders[i], NULL, encode_records, &pipeline) != 0) {
+            fprintf(stderr, "Failed to start batch encoder %d\n", i);
+            exit(1);
+        }
+    }
+
+    char *record = NULL;
+    int32_t recordLen = 0;
+    int64_t recordIndex = 0;
+    for (; batch_read_record(reader, &record, &recordLen); recordIndex++) {
+        wait_for_stage(&pipeline, recordIndex, 0);
+        BatchSlot *slot = &pipeline.slots[recordIndex % pipeline.slotsCount];
+        copy_options(&slot->options, defaults);
+        char *text = NULL;
+        batch_parse_record(record, recordLen, batch->hasRecordOptions, recordIndex, &slot->options, &text, &slot->textLen);
+        memcpy(slot->text, text, slot->textLen);
+        hand_over(&pipeline, slot, recordIndex + 1);
+    }
+    // Wake every stage waiting for a record that will never come.
+    pthread_mutex_lock(&pipeline.lock);
+    pipeline.recordsCount = recordIndex;
+    for (int32_t i = 0; i < pipeline.slotsCount; i++) {
+        pthread_cond_broadcast(&pipeline.slots[i].changed);
+    }
+    pthread_mutex_unlock(&pipeline.lock);
+
+    for (int32_t i = 0; i < batch->jobsCount; i++) {
+        pthread_join(encoders[i], NULL);
+    }
+    pthread_join(writer, NULL);
+    for (int32_t i = 0; i < pipeline.slotsCount; i++) {
+        pthread_cond_destroy(&pipeline.slots[i].changed);
+    }
+    pthread_mutex_destroy(&pipeline.lock);
+}
+
+void
+batch_run(QROptions *defaults, BatchOptions *batch)
+{
+    FILE *file = stdin;
+    if (batch->filepath != NULL) {
+        file = fopen(batch->filepath, "rb");
+        if (file == NULL) {
+            fprintf(stderr, "Failed to open file '%s': %s\n", batch->filepath, strerror(errno));
+            exit(1);
+        }
+    }
+
+    BatchReader reader;
+    batch_reader_init(&reader, file, batch->framing);
+
+    if (batch->jobsCount > 1) {
+        run_pipeline(defaults, batch, &reader);
+    }
+    else {
+        QRWorkspace workspace;
+        QROptions options;
+        char *record = NULL;
+        int32_t recordLen = 0;
+        while (batch_read_record(&reader, &record, &recordLen)) {
+            int64_t recordIndex = reader.recordsCount - 1;
+            copy_options(&options, defaults);
+            char *text = NULL;
+            int32_t textLen = 0;
+            batch_parse_record(record, recordLen, batch->hasRecordOptions, recordIndex, &options, &text, &textLen);
+
+            QR qr;
+            encode_record(text, textLen, &options, batch, &workspace, recordIndex, &qr);
+            if (recordIndex > 0) {
+                fwrite(batch->separator, 1, batch->separatorLen, stdout);
+            }
+            qr_print(stdout, &qr, &options.render);
+        }
+    }
+
+    if (file != stdin) {
+        fclose(file);
+    }
+    if (defaults->isDebug && batch->cache != NULL) {
+        QRCacheStats stats = qr_cache_stats(batch->cache);
+        fprintf(stderr, "Cache: %" PRId64 " hits, %" PRId64 " misses, %" PRId64 " evictions, %d entries, %zu of %zu bytes\n",
+                stats.hits, stats.misses, stats.evictions, stats.entriesCount, stats.usedBytes, stats.budgetBytes);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "qr.h"
+
+#define BATCH_MAX_OPTIONS_LEN 64
+#define BATCH_MAX_RECORD_LEN (BATCH_MAX_OPTIONS_LEN + MAX_TEXT_LEN)
+#define BATCH_BUFFER_SIZE (1 << 16)
+#define BATCH_MAX_SEPARATOR_LEN 64
+#define BATCH_MAX_JOBS 64
+
+typedef int32_t BatchFraming;
+enum BatchFraming
+{
+    BF_LINE,   // Records end with '\n'.
+    BF_NUL,    // Records end with '\0'.
+    BF_LENGTH, // Records start with their length as a 32-bit big-endian integer.
+
+    BF_COUNT,
+};
+
+global const char *const BatchFramingNames[BF_COUNT] = {
+    "LINE",
+    "NUL",
+    "LENGTH",
+};
+
+typedef struct BatchOptions BatchOptions;
+struct BatchOptions
+{
+    bool isEnabled;
+    BatchFraming framing;
+    bool hasRecordOptions; // Records start with "KEY=VALUE,...\t", where KEY is one of l, v, m, o, x, q.
+    char separator[BATCH_MAX_SEPARATOR_LEN];
+    int32_t separatorLen;
+    char *filepath; // NULL reads STDIN
+    int32_t jobsCount; // encoder threads, 1 encodes on the calling thread
+    QRCache *cache;    // NULL encodes every record
+    const QRProfile *profile; // pins the options of every record, NULL analyses each one
+};
+
+// Splits a stream into records, reading it in large chunks.
+typedef struct BatchReader BatchReader;
+struct BatchReader
+{
+    FILE *file;
+    BatchFraming framing;
+    int64_t recordsCount;
+    int32_t start;
+    int32_t end;
+    bool isEof;
+    char buffer[BATCH_BUFFER_SIZE];
+};
+
+void batch_reader_init(BatchReader *reader, FILE *file, BatchFraming framing);
+bool batch_read_record(BatchReader *reader, char **record, int32_t *recordLen);
+void batch_parse_record(char *record, int32_t recordLen, bool hasRecordOptions, int64_t recordIndex,
+                        QROptions *options, char **recordText, int32_t *recordTextLen);
+void batch_run(QROptions *defaults, BatchOptions *batch);
+
+#endif //BATCH_H
@@ -0,0 +1,378 @@
+// Benchmark of the stages of qr_encode and of qr_print, timed in process over the inputs of the tests,
+// which cover every mode, level and version. Includes qr.c for its internal stages, so it links without qr.o.
+// Prints one JSON result per line, so two runs can be compared with diff or with -b.
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qr.c"
+
+#define BENCH_MAX_INPUTS (EM_COUNT * ECL_COUNT * VERSION_COUNT)
+#define BENCH_MAX_REPETITIONS 10000
+#define BENCH_MIN_SAMPLE_NS 2000 // samples repeat fast stages until they take this long, so the clock is negligible
+#define BENCH_MAX_SAMPLE_ITERATIONS (1 << 20)
+#define BENCH_DEFAULT_WARMUP 10
+#define BENCH_DEFAULT_REPETITIONS 100
+
+typedef int32_t BenchStage;
+enum BenchStage
+{
+    BS_ANALYSE_DATA,
+    BS_ENCODE_DATA,
+    BS_PREPARE_CODEWORDS,
+    BS_PLACEMENT, // draw_template and draw_data
+    BS_MASKING,   // apply_mask
+    BS_PENALTY,   // calc_mask_penalty
+    BS_DRAW_MATRIX,
+    BS_PRINT, // qr_print of OutputFormat stage - BS_PRINT
+
+    BS_COUNT = BS_PRINT + OF_COUNT,
+};
+
+global const char *const BenchStageNames[BS_COUNT] = {
+    "analyse_data",
+    "encode_data",
+    "prepare_codewords",
+    "draw_matrix.placement",
+    "draw_matrix.masking",
+    "draw_matrix.penalty",
+    "draw_matrix",
+    "qr_print.ANSI",
+    "qr_print.ASCII",
+    "qr_print.UTF8",
+    "qr_print.UTF8Q",
+    "qr_print.ANSI_RLE",
+    "qr_print.ANSI_RGB",
+    "qr_print.ANSI_HALF",
+    "qr_print.PBM",
+    "qr_print.PGM",
+    "qr_print.PNG",
+    "qr_print.PNG_STORED",
+    "qr_print.SVG",
+    "qr_print.SVG_CRISP",
+};
+
+typedef struct BenchInput BenchInput;
+struct BenchInput
+{
+    EncodingMode mode;
+    ErrorCorrectionLevel level;
+    int32_t version;
+    int32_t textLen;
+    char text[MAX_TEXT_LEN];
+};
+
+global BenchInput INPUTS[BENCH_MAX_INPUTS];
+global QRWorkspace WORKSPACE;
+global double SAMPLES[BENCH_MAX_REPETITIONS];
+global double BASELINE_NS[BS_COUNT][EM_COUNT][ECL_COUNT][VERSION_COUNT]; // 0 when the baseline has no result
+global volatile int32_t SINK; // keeps the penalty from being optimised away
+
+internal int32_t
+find_name(const char *const *names, int32_t namesCount, const char *name)
+{
+    for (int32_t i = 0; i < namesCount; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+internal int64_t
+get_time_ns(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+internal int32_t
+compare_inputs(const void *a, const void *b)
+{
+    const BenchInput *inputA = a;
+    const BenchInput *inputB = b;
+    if (inputA->mode != inputB->mode) {
+        return inputA->mode - inputB->mode;
+    }
+    if (inputA->level != inputB->level) {
+        return inputA->level - inputB->level;
+    }
+    return inputA->version - inputB->version;
+}
+
+internal int32_t
+compare_samples(const void *a, const void *b)
+{
+    double sampleA = *(const double *)a;
+    double sampleB = *(const double *)b;
+    return (sampleA > sampleB) - (sampleA < sampleB);
+}
+
+// Reads the test_MODE_LEVEL_VERSION_LENGTH.in files of dirPath, sorted by mode, level and version.
+internal int32_t
+read_inputs(const char *dirPath)
+{
+    DIR *dir = opendir(dirPath);
+    if (dir == NULL) {
+        fprintf(stderr, "Failed to open directory '%s': %s\n", dirPath, strerror(errno));
+        exit(1);
+    }
+    int32_t inputsCount = 0;
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir)) {
+        int32_t mode = 0;
+        int32_t level = 0;
+        int32_t version = 0;
+        int32_t length = 0;
+        int32_t nameLen = 0;
+        if (sscanf(entry->d_name, "test_%d_%d_%d_%d.in%n", &mode, &level, &version, &length, &nameLen) != 4
+            || entry->d_name[nameLen] != '\0') {
+            continue;
+        }
+        if (mode < 0 || mode >= EM_COUNT || level < ECL_LOW || level > ECL_HIGH || version < MIN_VERSION + 1
+            || version > MAX_VERSION + 1 || inputsCount == BENCH_MAX_INPUTS) {
+            fprintf(stderr, "Unexpected input: %s\n", entry->d_name);
+            exit(1);
+        }
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dirPath, entry->d_name);
+        FILE *file = fopen(path, "rb");
+        if (file == NULL) {
+            fprintf(stderr, "Failed to open file '%s': %s\n", path, strerror(errno));
+            exit(1);
+        }
+        BenchInput *input = &INPUTS[inputsCount++];
+        input->mode = mode;
+        input->level = level;
+        input->version = version - 1;
+        input->textLen = (int32_t)fread(input->text, 1, sizeof(input->text), file);
+        fclose(file);
+    }
+    closedir(dir);
+    if (inputsCount == 0) {
+        fprintf(stderr, "No test_*.in files in '%s'\n", dirPath);
+        exit(1);
+    }
+    qsort(INPUTS, (size_t)inputsCount, sizeof(INPUTS[0]), compare_inputs);
+    return inputsCount;
+}
+
+// Reads the results of a previous run, ignoring the lines that are not results.
+internal void
+read_baseline(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open file '%s': %s\n", path, strerror(errno));
+        exit(1);
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char stageName[64];
+        char modeName[32];
+        char levelName[32];
+        int32_t version = 0;
+        double nsPerOp = 0;
+        if (sscanf(line, " {\"stage\": \"%63[^\"]\", \"mode\": \"%31[^\"]\", \"level\": \"%31[^\"]\", \"version\": %d, "
+                         "\"bytes\": %*d, \"ns_per_op\": %lf", stageName, modeName, levelName, &version, &nsPerOp) != 5) {
+            continue;
+        }
+        int32_t stage = find_name(BenchStageNames, BS_COUNT, stageName);
+        int32_t mode = find_name(EncodingModeNames, EM_COUNT, modeName);
+        int32_t level = find_name(ErrorCorrectionLevelNames, ECL_COUNT, levelName);
+        if (stage >= 0 && mode >= 0 && level >= 0 && 1 <= version && version <= VERSION_COUNT) {
+            BASELINE_NS[stage][mode][level][version - 1] = nsPerOp;
+        }
+    }
+    fclose(file);
+}
+
+// Leaves the workspace and qr as the stage reads them. Every stage writes the same values on every run,
+// except masking, which toggles the mask.
+internal void
+prepare_stage(BenchStage stage, const BenchInput *input, QR *qr)
+{
+    Workspace *scratch = (Workspace *)WORKSPACE.bytes;
+    if (stage == BS_PENALTY) {
+        draw_template(qr);
+        draw_data(qr, &scratch->codewords);
+        apply_mask(qr, input->version % MASK_COUNT);
+    }
+}
+
+internal void
+run_stage(BenchStage stage, const BenchInput *input, QR *qr, const QRRenderOptions *render, FILE *out)
+{
+    Workspace *scratch = (Workspace *)WORKSPACE.bytes;
+    switch (stage) {
+        case BS_ANALYSE_DATA: {
+            analyse_data(input->text, input->textLen, input->level, input->version, qr, scratch, false);
+        } break;
+        case BS_ENCODE_DATA: encode_data(qr, input->text, &scratch->segments, &scratch->bv, false); break;
+        case BS_PREPARE_CODEWORDS: prepare_codewords(qr, &scratch->bv, &scratch->codewords, false); break;
+        case BS_PLACEMENT: {
+            draw_template(qr);
+            draw_data(qr, &scratch->codewords);
+        } break;
+        case BS_MASKING: apply_mask(qr, input->version % MASK_COUNT); break;
+        case BS_PENALTY: SINK = calc_mask_penalty(qr); break;
+        case BS_DRAW_MATRIX: draw_matrix(qr, &scratch->codewords, MASK_INVALID, MS_SEQUENTIAL, render, false); break;
+        default: qr_print(out, qr, render);
+    }
+}
+
+// Times samples of repeated runs after warming up, and fills SAMPLES with the nanoseconds per run, sorted.
+internal void
+time_stage(BenchStage stage, const BenchInput *input, QR *qr, const QRRenderOptions *render, FILE *out,
+           int32_t warmupCount, int32_t repetitionsCount)
+{
+    // The warm-up also finds how many runs make a sample long enough.
+    int32_t iterationsCount = 1;
+    for (int32_t i = 0; i < warmupCount; i++) {
+        int64_t start = get_time_ns();
+        for (int32_t j = 0; j < iterationsCount; j++) {
+            run_stage(stage, input, qr, render, out);
+        }
+        int64_t elapsed = get_time_ns() - start;
+        if (elapsed < BENCH_MIN_SAMPLE_NS && iterationsCount < BENCH_MAX_SAMPLE_ITERATIONS) {
+            iterationsCount *= 2;
+        }
+    }
+    for (int32_t i = 0; i < repetitionsCount; i++) {
+        int64_t start = get_time_ns();
+        for (int32_t j = 0; j < iterationsCount; j++) {
+            run_stage(stage, input, qr, render, out);
+        }
+        SAMPLES[i] = (double)(get_time_ns() - start) / iterationsCount;
+    }
+    qsort(SAMPLES, (size_t)repetitionsCount, sizeof(SAMPLES[0]), compare_samples);
+}
+
+internal int32_t
+parse_count(char *exe, const char *name, const char *value, int32_t min, int32_t max)
+{
+    char *end = NULL;
+    long count = (value != NULL) ? strtol(value, &end, 10) : 0;
+    if (value == NULL || *end != '\0' || count < min || count > max) {
+        fprintf(stderr, "%s must be a number from %d to %d\n", name, min, max);
+        fprintf(stderr, "Usage: %s [-d DIR] [-w WARMUP] [-n REPETITIONS] [-b BASELINE]\n", exe);
+        exit(1);
+    }
+    return (int32_t)count;
+}
+
+int32_t
+main(int32_t argc, char **argv)
+{
+    const char *dirPath = "tests";
+    const char *baselinePath = NULL;
+    int32_t warmupCount = BENCH_DEFAULT_WARMUP;
+    int32_t repetitionsCount = BENCH_DEFAULT_REPETITIONS;
+    for (int32_t i = 1; i < argc; i++) {
+        char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+        if (strcmp(argv[i], "-d") == 0 && value != NULL) {
+            dirPath = value;
+        }
+        else if (strcmp(argv[i], "-b") == 0 && value != NULL) {
+            baselinePath = value;
+        }
+        else if (strcmp(argv[i], "-w") == 0) {
+            warmupCount = parse_count(argv[0], "WARMUP", value, 1, BENCH_MAX_REPETITIONS);
+        }
+        else if (strcmp(argv[i], "-n") == 0) {
+            repetitionsCount = parse_count(argv[0], "REPETITIONS", value, 1, BENCH_MAX_REPETITIONS);
+        }
+        else {
+            fprintf(stderr, "Usage: %s [-d DIR] [-w WARMUP] [-n REPETITIONS] [-b BASELINE]\n", argv[0]);
+            fprintf(stderr, "Times the stages of encoding the test_*.in files of DIR, tests by default,\n");
+            fprintf(stderr, "and prints the results as JSON, compared to those of BASELINE if given.\n");
+            return 1;
+        }
+        i++;
+    }
+
+    int32_t inputsCount = read_inputs(dirPath);
+    if (baselinePath != NULL) {
+        read_baseline(baselinePath);
+    }
+    FILE *out = fopen("/dev/null", "w");
+    if (out == NULL) {
+        fprintf(stderr, "Failed to open /dev/null: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // Per stage, the log of the ratio to the baseline summed over the inputs the baseline has.
+    double logRatioSums[BS_COUNT] = {};
+    int32_t ratiosCounts[BS_COUNT] = {};
+
+    printf("{\"warmup\": %d, \"repetitions\": %d, \"results\": [\n", warmupCount, repetitionsCount);
+    bool isFirst = true;
+    for (int32_t i = 0; i < inputsCount; i++) {
+        const BenchInput *input = &INPUTS[i];
+        if (i == 0 || input->mode != INPUTS[i - 1].mode || input->level != INPUTS[i - 1].level) {
+            fprintf(stderr, "Timing %s %s\n", EncodingModeNames[input->mode], ErrorCorrectionLevelNames[input->level]);
+        }
+        QR qr;
+        QRRenderOptions render = {.format = OF_ASCII, .scale = MIN_SCALE, .quietZone = DEFAULT_QUIET_ZONE};
+        QROptions options = {.forcedLevel = input->level, .forcedVersion = input->version,
+                             .forcedMask = MASK_INVALID, .maskSearch = MS_SEQUENTIAL, .render = render};
+        QRStatus status = qr_encode(input->text, input->textLen, &options, &WORKSPACE, &qr);
+        if (status != QR_OK) {
+            fprintf(stderr, "Failed to encode test_%d_%d_%02d: %s\n", input->mode, input->level, input->version + 1,
+                    qr_status_message(status));
+            return 1;
+        }
+        if (qr.mode != input->mode) {
+            fprintf(stderr, "test_%d_%d_%02d is not encoded in mode %s\n", input->mode, input->level,
+                    input->version + 1, EncodingModeNames[input->mode]);
+            return 1;
+        }
+
+        for (BenchStage stage = 0; stage < BS_COUNT; stage++) {
+            // Stages before printing process the text, printing produces the rendering.
+            int64_t bytesCount = input->textLen;
+            if (stage >= BS_PRINT) {
+                render.format = stage - BS_PRINT;
+                bytesCount = (int64_t)qr_render(&qr, &render, NULL, 0);
+            }
+            prepare_stage(stage, input, &qr);
+            time_stage(stage, input, &qr, &render, out, warmupCount, repetitionsCount);
+
+            double nsPerOp = SAMPLES[repetitionsCount / 2];
+            double p99Ns = SAMPLES[(repetitionsCount * 99 + 99) / 100 - 1];
+            printf("%s  {\"stage\": \"%s\", \"mode\": \"%s\", \"level\": \"%s\", \"version\": %d, \"bytes\": %" PRId64
+                   ", \"ns_per_op\": %.1f, \"p99_ns\": %.1f, \"symbols_per_s\": %.0f, \"mb_per_s\": %.2f",
+                   isFirst ? "" : ",\n", BenchStageNames[stage], EncodingModeNames[input->mode],
+                   ErrorCorrectionLevelNames[input->level], input->version + 1, bytesCount, nsPerOp, p99Ns,
+                   1e9 / nsPerOp, (double)bytesCount * 1e3 / nsPerOp);
+            double baselineNs = BASELINE_NS[stage][input->mode][input->level][input->version];
+            if (baselineNs > 0) {
+                printf(", \"baseline_ns_per_op\": %.1f, \"speedup\": %.3f", baselineNs, baselineNs / nsPerOp);
+                logRatioSums[stage] += log(baselineNs / nsPerOp);
+                ratiosCounts[stage]++;
+            }
+            printf("}");
+            isFirst = false;
+        }
+    }
+    printf("\n]}\n");
+    fclose(out);
+
+    if (baselinePath != NULL) {
+        fprintf(stderr, "Geometric mean speedup over %s:\n", baselinePath);
+        for (BenchStage stage = 0; stage < BS_COUNT; stage++) {
+            if (ratiosCounts[stage] > 0) {
+                fprintf(stderr, "    %-22s %.3f\n", BenchStageNames[stage],
+                        exp(logRatioSums[stage] / ratiosCounts[stage]));
+            }
+        }
+    }
+    return 0;
+}
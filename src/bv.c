@@ -1,20 +1,49 @@
+#include <string.h>
+
 #include "utils.h"
 #include "bv.h"
 
+internal uint64_t
+swap_big_endian(uint64_t word)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(word);
+#else
+    return word;
+#endif
+}
+
+internal void
+write_word(BitVec *bv, uint64_t word)
+{
+    int32_t offset = (bv->size - bv->accCount) / 8;
+    uint64_t bigEndianWord = swap_big_endian(word);
+    memcpy(&bv->bytes[offset], &bigEndianWord, sizeof(bigEndianWord));
+}
+
+// Empties the vector, the bytes are written before they are read.
 void
-bv_print_bin(FILE *out, BitVec bv)
+bv_init(BitVec *bv)
 {
-    for (int32_t i = 0; i < bv.size; i++) {
-        fprintf(out, "%c%s", ((bv.bytes[i / 8] >> (7 - (i % 8))) & 1) ? '1' : '0', (((i + 1) % 8) == 0) ? " " : "");
+    bv->size = 0;
+    bv->acc = 0;
+    bv->accCount = 0;
+}
+
+void
+bv_print_bin(FILE *out, const BitVec *bv)
+{
+    for (int32_t i = 0; i < bv->size; i++) {
+        fprintf(out, "%c%s", ((bv->bytes[i / 8] >> (7 - (i % 8))) & 1) ? '1' : '0', (((i + 1) % 8) == 0) ? " " : "");
     }
     fprintf(out, "\n");
 }
 
 void
-bv_print_hex(FILE *out, BitVec bv)
+bv_print_hex(FILE *out, const BitVec *bv)
 {
-    for (int32_t i = 0; i < bv.size; i += 8) {
-        fprintf(out, "%02X ", bv.bytes[i / 8]);
+    for (int32_t i = 0; i < bv->size; i += 8) {
+        fprintf(out, "%02X ", bv->bytes[i / 8]);
     }
     fprintf(out, "\n");
 }
@@ -24,10 +53,63 @@ bv_append(BitVec *bv, uint64_t bits, int32_t bitsCount)
 {
     ASSERT(0 <= bitsCount && bitsCount <= 64);
     ASSERT((bitsCount == 64) || ((bits >> bitsCount) == 0));
-    ASSERT((bv->size + bitsCount) <= (ARRAY_CAP(bv->bytes) * 8));
+    ASSERT((bv->size + bitsCount) <= MAX_BITS_COUNT);
 
-    while (bitsCount--) {
-        bv->bytes[bv->size / 8] |= ((bits >> bitsCount) & 1) << (7 - (bv->size % 8));
-        bv->size++;
+    if (bitsCount == 0) {
+        return;
+    }
+    int32_t freeCount = 64 - bv->accCount;
+    if (bitsCount < freeCount) {
+        bv->acc |= bits << (freeCount - bitsCount);
+        bv->accCount += bitsCount;
+    }
+    else {
+        int32_t restCount = bitsCount - freeCount;
+        write_word(bv, bv->acc | (bits >> restCount));
+        bv->acc = (restCount == 0) ? 0 : (bits << (64 - restCount));
+        bv->accCount = restCount;
+    }
+    bv->size += bitsCount;
+}
+
+void
+bv_append_bytes(BitVec *bv, const uint8_t *bytes, int32_t bytesCount)
+{
+    ASSERT((bv->size + bytesCount * 8) <= MAX_BITS_COUNT);
+
+    if ((bv->size % 8) == 0) {
+        // Byte aligned: write the pending bytes, copy and reload the accumulator from the last whole word.
+        bv_flush(bv);
+        memcpy(&bv->bytes[bv->size / 8], bytes, bytesCount);
+        bv->size += bytesCount * 8;
+        bv->accCount = bv->size % 64;
+        if (bv->accCount == 0) {
+            bv->acc = 0;
+        }
+        else {
+            uint64_t word;
+            memcpy(&word, &bv->bytes[(bv->size - bv->accCount) / 8], sizeof(word));
+            bv->acc = swap_big_endian(word) & ~(~0ULL >> bv->accCount);
+        }
+        return;
+    }
+
+    // Unaligned: shift-merge whole words through the accumulator.
+    int32_t i = 0;
+    for (; i + 8 <= bytesCount; i += 8) {
+        uint64_t word;
+        memcpy(&word, &bytes[i], sizeof(word));
+        bv_append(bv, swap_big_endian(word), 64);
+    }
+    for (; i < bytesCount; i++) {
+        bv_append(bv, bytes[i], 8);
+    }
+}
+
+void
+bv_flush(BitVec *bv)
+{
+    if (bv->accCount > 0) {
+        write_word(bv, bv->acc);
     }
 }
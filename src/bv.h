@@ -6,15 +6,22 @@
 
 #define MAX_BITS_COUNT 30000
 
+// Big-endian bit writer. Bits are gathered in a 64-bit accumulator and written out a whole word at a time,
+// call bv_flush before reading bytes.
 typedef struct BitVec BitVec;
 struct BitVec
 {
-    uint8_t bytes[MAX_BITS_COUNT / 8];
+    uint8_t bytes[MAX_BITS_COUNT / 8 + 8]; // room for flushing a whole word at the end
     int32_t size;
+    uint64_t acc;     // bits after the last written word, left aligned
+    int32_t accCount;
 };
 
-void bv_print_bin(FILE *out, BitVec bv);
-void bv_print_hex(FILE *out, BitVec bv);
+void bv_init(BitVec *bv);
+void bv_print_bin(FILE *out, const BitVec *bv);
+void bv_print_hex(FILE *out, const BitVec *bv);
 void bv_append(BitVec *bv, uint64_t bits, int32_t bitsCount);
+void bv_append_bytes(BitVec *bv, const uint8_t *bytes, int32_t bytesCount);
+void bv_flush(BitVec *bv);
 
 #endif //BV_H
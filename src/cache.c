@@ -0,0 +1,480 @@
+#include <pthread.h>
+#include <string.h>
+
+#include "utils.h"
+#include "qr.h"
+
+#define CACHE_CHUNK_SIZE 1024
+#define CACHE_CHUNK_DATA_SIZE (CACHE_CHUNK_SIZE - 8)
+#define CACHE_NONE (-1)
+#define CACHE_MAX_ENTRY_SHARE 16 // of the chunks, so a single large rendering cannot flush the cache
+
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry
+{
+    uint64_t hash;
+    int32_t bucketNext;
+    int32_t lruPrevious; // more recently used
+    int32_t lruNext;     // less recently used
+    int32_t chunksCount;
+    int32_t textLen;
+    ErrorCorrectionLevel forcedLevel;
+    int32_t forcedVersion;
+    int32_t forcedMask;
+    bool isRendered;
+    QRRenderOptions render;
+    size_t renderedLen;
+    int32_t size;
+    int32_t rowWords;
+    EncodingMode mode;
+    ErrorCorrectionLevel level;
+    int32_t version;
+    int32_t mask;
+    int32_t penalty;
+};
+
+// Entries are chains of chunks that hold the entry, the text, the dark and the functional modules of the rows
+// and the rendering, one after another.
+typedef struct CacheChunk CacheChunk;
+struct CacheChunk
+{
+    union
+    {
+        CacheEntry entry; // in the first chunk of an entry
+        uint8_t bytes[CACHE_CHUNK_DATA_SIZE];
+    };
+    int32_t next;
+};
+
+static_assert(sizeof(CacheChunk) == CACHE_CHUNK_SIZE);
+
+struct QRCache
+{
+    pthread_mutex_t lock;
+    CacheChunk *chunks;
+    int32_t *buckets; // first entry of every hash bucket
+    int32_t chunksCount;
+    int32_t bucketsMask;
+    int32_t usedChunksCount;
+    int32_t freeChunk;      // head of the list of the chunks of evicted entries
+    int32_t untouchedChunk; // chunks from here on were never used, so the memory is only touched as the cache fills
+    int32_t lruFirst;
+    int32_t lruLast;
+    QRCacheStats stats;
+};
+
+typedef struct CacheCursor CacheCursor;
+struct CacheCursor
+{
+    CacheChunk *chunks;
+    int32_t chunk;
+    int32_t offset;
+};
+
+__extension__ typedef unsigned __int128 CacheProduct;
+
+internal uint64_t
+mix(uint64_t a, uint64_t b)
+{
+    CacheProduct product = (CacheProduct)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+internal uint64_t
+read_u64(const uint8_t *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Folds 16 bytes at a time with 64×64→128-bit multiplications, as wyhash does.
+internal uint64_t
+hash_key(const char *text, int32_t textLen, const QROptions *options)
+{
+    const uint64_t SECRETS[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull};
+    uint64_t seed = ((uint64_t)(uint32_t)options->forcedLevel << 40) ^ ((uint64_t)(uint32_t)options->forcedVersion << 20)
+        ^ (uint64_t)(uint32_t)options->forcedMask;
+    uint64_t hash = seed ^ mix(seed ^ SECRETS[0], SECRETS[1]);
+    const uint8_t *bytes = (const uint8_t *)text;
+    int32_t i = 0;
+    for (; i + 16 <= textLen; i += 16) {
+        hash = mix(read_u64(bytes + i) ^ SECRETS[1], read_u64(bytes + i + 8) ^ hash);
+    }
+    uint8_t tail[16] = {};
+    memcpy(tail, bytes + i, textLen - i);
+    hash = mix(read_u64(tail) ^ SECRETS[2], read_u64(tail + 8) ^ hash);
+    return mix(hash ^ SECRETS[3], (uint64_t)textLen ^ SECRETS[1]);
+}
+
+// Returns the next contiguous span of up to len bytes of the entry and moves past it.
+internal uint8_t *
+cursor_next_span(CacheCursor *cursor, size_t len, size_t *spanLen)
+{
+    if (cursor->offset == CACHE_CHUNK_DATA_SIZE) {
+        cursor->chunk = cursor->chunks[cursor->chunk].next;
+        cursor->offset = 0;
+    }
+    *spanLen = MIN(len, (size_t)(CACHE_CHUNK_DATA_SIZE - cursor->offset));
+    uint8_t *span = cursor->chunks[cursor->chunk].bytes + cursor->offset;
+    cursor->offset += (int32_t)*spanLen;
+    return span;
+}
+
+internal void
+cursor_write(CacheCursor *cursor, const void *bytes, size_t len)
+{
+    for (size_t spanLen = 0; len > 0; bytes = (const uint8_t *)bytes + spanLen, len -= spanLen) {
+        uint8_t *span = cursor_next_span(cursor, len, &spanLen);
+        memcpy(span, bytes, spanLen);
+    }
+}
+
+internal void
+cursor_read(CacheCursor *cursor, void *bytes, size_t len)
+{
+    for (size_t spanLen = 0; len > 0; bytes = (uint8_t *)bytes + spanLen, len -= spanLen) {
+        uint8_t *span = cursor_next_span(cursor, len, &spanLen);
+        memcpy(bytes, span, spanLen);
+    }
+}
+
+internal bool
+cursor_equals(CacheCursor *cursor, const void *bytes, size_t len)
+{
+    for (size_t spanLen = 0; len > 0; bytes = (const uint8_t *)bytes + spanLen, len -= spanLen) {
+        uint8_t *span = cursor_next_span(cursor, len, &spanLen);
+        if (memcmp(span, bytes, spanLen) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+internal void
+cursor_skip(CacheCursor *cursor, size_t len)
+{
+    for (size_t spanLen = 0; len > 0; len -= spanLen) {
+        cursor_next_span(cursor, len, &spanLen);
+    }
+}
+
+internal CacheCursor
+cursor_at_text(QRCache *cache, int32_t index)
+{
+    return (CacheCursor){.chunks = cache->chunks, .chunk = index, .offset = sizeof(CacheEntry)};
+}
+
+internal bool
+is_render_valid(const QRRenderOptions *render)
+{
+    return 0 <= render->format && render->format < OF_COUNT && MIN_SCALE <= render->scale && render->scale <= MAX_SCALE
+        && 0 <= render->quietZone && render->quietZone <= MAX_QUIET_ZONE;
+}
+
+internal int32_t
+find_entry(QRCache *cache, uint64_t hash, const char *text, int32_t textLen, const QROptions *options)
+{
+    for (int32_t index = cache->buckets[hash & cache->bucketsMask]; index != CACHE_NONE;) {
+        CacheEntry *entry = &cache->chunks[index].entry;
+        bool isKeyEqual = entry->hash == hash && entry->textLen == textLen && entry->forcedLevel == options->forcedLevel
+            && entry->forcedVersion == options->forcedVersion && entry->forcedMask == options->forcedMask;
+        if (isKeyEqual) {
+            CacheCursor cursor = cursor_at_text(cache, index);
+            if (cursor_equals(&cursor, text, (size_t)textLen)) {
+                return index;
+            }
+        }
+        index = entry->bucketNext;
+    }
+    return CACHE_NONE;
+}
+
+internal void
+unlink_lru(QRCache *cache, int32_t index)
+{
+    CacheEntry *entry = &cache->chunks[index].entry;
+    if (entry->lruPrevious != CACHE_NONE) {
+        cache->chunks[entry->lruPrevious].entry.lruNext = entry->lruNext;
+    }
+    else {
+        cache->lruFirst = entry->lruNext;
+    }
+    if (entry->lruNext != CACHE_NONE) {
+        cache->chunks[entry->lruNext].entry.lruPrevious = entry->lruPrevious;
+    }
+    else {
+        cache->lruLast = entry->lruPrevious;
+    }
+}
+
+internal void
+push_lru(QRCache *cache, int32_t index)
+{
+    CacheEntry *entry = &cache->chunks[index].entry;
+    entry->lruPrevious = CACHE_NONE;
+    entry->lruNext = cache->lruFirst;
+    if (cache->lruFirst != CACHE_NONE) {
+        cache->chunks[cache->lruFirst].entry.lruPrevious = index;
+    }
+    else {
+        cache->lruLast = index;
+    }
+    cache->lruFirst = index;
+}
+
+internal void
+remove_entry(QRCache *cache, int32_t index)
+{
+    CacheEntry *entry = &cache->chunks[index].entry;
+    int32_t *link = &cache->buckets[entry->hash & cache->bucketsMask];
+    while (*link != index) {
+        link = &cache->chunks[*link].entry.bucketNext;
+    }
+    *link = entry->bucketNext;
+    unlink_lru(cache, index);
+
+    int32_t lastChunk = index;
+    while (cache->chunks[lastChunk].next != CACHE_NONE) {
+        lastChunk = cache->chunks[lastChunk].next;
+    }
+    cache->chunks[lastChunk].next = cache->freeChunk;
+    cache->freeChunk = index;
+    cache->usedChunksCount -= entry->chunksCount;
+    cache->stats.entriesCount--;
+}
+
+internal int32_t
+allocate_chunk(QRCache *cache)
+{
+    if (cache->freeChunk != CACHE_NONE) {
+        int32_t chunk = cache->freeChunk;
+        cache->freeChunk = cache->chunks[chunk].next;
+        return chunk;
+    }
+    return cache->untouchedChunk++;
+}
+
+internal void
+insert_entry(QRCache *cache, uint64_t hash, const char *text, int32_t textLen, const QROptions *options, const QR *qr,
+             const char *rendered, size_t renderedLen)
+{
+    size_t wordsLen = (size_t)(qr->size * qr->rowWords) * sizeof(uint64_t);
+    size_t maxLen = (size_t)MAX(cache->chunksCount / CACHE_MAX_ENTRY_SHARE, 1) * CACHE_CHUNK_DATA_SIZE;
+    size_t dataLen = sizeof(CacheEntry) + (size_t)textLen + 2 * wordsLen;
+    if (dataLen + renderedLen > maxLen) {
+        rendered = NULL;
+        renderedLen = 0;
+    }
+    if (dataLen > maxLen) {
+        return;
+    }
+    dataLen += renderedLen;
+    int32_t chunksCount = (int32_t)((dataLen + CACHE_CHUNK_DATA_SIZE - 1) / CACHE_CHUNK_DATA_SIZE);
+
+    // Another thread may have cached the same symbol meanwhile, or this adds the rendering.
+    int32_t existing = find_entry(cache, hash, text, textLen, options);
+    if (existing != CACHE_NONE) {
+        remove_entry(cache, existing);
+    }
+    while (cache->chunksCount - cache->usedChunksCount < chunksCount) {
+        remove_entry(cache, cache->lruLast);
+        cache->stats.evictions++;
+    }
+
+    int32_t index = allocate_chunk(cache);
+    int32_t lastChunk = index;
+    for (int32_t i = 1; i < chunksCount; i++) {
+        int32_t chunk = allocate_chunk(cache);
+        cache->chunks[lastChunk].next = chunk;
+        lastChunk = chunk;
+    }
+    cache->chunks[lastChunk].next = CACHE_NONE;
+    cache->usedChunksCount += chunksCount;
+
+    CacheEntry *entry = &cache->chunks[index].entry;
+    entry->hash = hash;
+    entry->chunksCount = chunksCount;
+    entry->textLen = textLen;
+    entry->forcedLevel = options->forcedLevel;
+    entry->forcedVersion = options->forcedVersion;
+    entry->forcedMask = options->forcedMask;
+    entry->isRendered = rendered != NULL;
+    entry->render = options->render;
+    entry->renderedLen = renderedLen;
+    entry->size = qr->size;
+    entry->rowWords = qr->rowWords;
+    entry->mode = qr->mode;
+    entry->level = qr->level;
+    entry->version = qr->version;
+    entry->mask = qr->mask;
+    entry->penalty = qr->penalty;
+    CacheCursor cursor = cursor_at_text(cache, index);
+    cursor_write(&cursor, text, (size_t)textLen);
+    cursor_write(&cursor, qr->colors, wordsLen);
+    cursor_write(&cursor, qr->functional, wordsLen);
+    cursor_write(&cursor, rendered, renderedLen);
+
+    int32_t *bucket = &cache->buckets[hash & cache->bucketsMask];
+    entry->bucketNext = *bucket;
+    *bucket = index;
+    push_lru(cache, index);
+    cache->stats.entriesCount++;
+}
+
+// Copies the symbol of the entry into qr, and its rendering into buffer if it has the given render options and fits.
+// Returns whether it had the rendering.
+internal bool
+read_entry(QRCache *cache, int32_t index, const QRRenderOptions *render, QR *qr, char *buffer, size_t bufferSize,
+           size_t *renderedSize)
+{
+    CacheEntry *entry = &cache->chunks[index].entry;
+    qr->size = entry->size;
+    qr->rowWords = entry->rowWords;
+    qr->mode = entry->mode;
+    qr->level = entry->level;
+    qr->version = entry->version;
+    qr->mask = entry->mask;
+    qr->penalty = entry->penalty;
+    size_t wordsLen = (size_t)(qr->size * qr->rowWords) * sizeof(uint64_t);
+    CacheCursor cursor = cursor_at_text(cache, index);
+    cursor_skip(&cursor, (size_t)entry->textLen);
+    cursor_read(&cursor, qr->colors, wordsLen);
+    cursor_read(&cursor, qr->functional, wordsLen);
+
+    bool isRendered = renderedSize != NULL && entry->isRendered && entry->render.format == render->format
+        && entry->render.scale == render->scale && entry->render.quietZone == render->quietZone;
+    if (isRendered) {
+        *renderedSize = entry->renderedLen;
+        if (entry->renderedLen <= bufferSize) {
+            cursor_read(&cursor, buffer, entry->renderedLen);
+        }
+    }
+    return isRendered;
+}
+
+// Renders into buffer unless renderedSize is NULL.
+internal QRStatus
+cache_encode(QRCache *cache, const char *text, int32_t textLen, const QROptions *options, QRWorkspace *workspace,
+             QR *qr, char *buffer, size_t bufferSize, size_t *renderedSize)
+{
+    bool isCacheable = cache != NULL && text != NULL && options != NULL && qr != NULL && 0 < textLen
+        && textLen <= MAX_TEXT_LEN && is_render_valid(&options->render);
+    if (!isCacheable) {
+        // qr_encode reports the errors.
+        QRStatus status = qr_encode(text, textLen, options, workspace, qr);
+        if (status == QR_OK && renderedSize != NULL) {
+            *renderedSize = qr_render(qr, &options->render, buffer, bufferSize);
+        }
+        return status;
+    }
+
+    uint64_t hash = hash_key(text, textLen, options);
+    pthread_mutex_lock(&cache->lock);
+    int32_t index = find_entry(cache, hash, text, textLen, options);
+    bool isHit = index != CACHE_NONE;
+    bool isRenderedHit = false;
+    if (isHit) {
+        cache->stats.hits++;
+        unlink_lru(cache, index);
+        push_lru(cache, index);
+        isRenderedHit = read_entry(cache, index, &options->render, qr, buffer, bufferSize, renderedSize);
+    }
+    else {
+        cache->stats.misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (isHit && (renderedSize == NULL || isRenderedHit)) {
+        return QR_OK;
+    }
+
+    // Encode and render without holding the lock.
+    if (!isHit) {
+        QRStatus status = qr_encode(text, textLen, options, workspace, qr);
+        if (status != QR_OK) {
+            return status;
+        }
+    }
+    const char *rendered = NULL;
+    size_t renderedLen = 0;
+    if (renderedSize != NULL) {
+        *renderedSize = qr_render(qr, &options->render, buffer, bufferSize);
+        if (*renderedSize <= bufferSize) {
+            rendered = buffer;
+            renderedLen = *renderedSize;
+        }
+    }
+    if (!isHit || rendered != NULL) {
+        pthread_mutex_lock(&cache->lock);
+        insert_entry(cache, hash, text, textLen, options, qr, rendered, renderedLen);
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return QR_OK;
+}
+
+QRCache *
+qr_cache_init(void *memory, size_t memorySize)
+{
+    if (memory == NULL) {
+        return NULL;
+    }
+    uintptr_t start = ((uintptr_t)memory + 63) & ~(uintptr_t)63;
+    size_t headerLen = (start - (uintptr_t)memory) + ((sizeof(QRCache) + 63) & ~(size_t)63);
+    if (memorySize < headerLen) {
+        return NULL;
+    }
+    // Every chunk takes at least one bucket.
+    size_t chunksCount = MIN((memorySize - headerLen) / (sizeof(CacheChunk) + sizeof(int32_t)), (size_t)1 << 30);
+    if (chunksCount == 0) {
+        return NULL;
+    }
+    size_t bucketsCount = 1;
+    while (2 * bucketsCount <= chunksCount) {
+        bucketsCount *= 2;
+    }
+
+    QRCache *cache = (QRCache *)start;
+    *cache = (QRCache){};
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->chunks = (CacheChunk *)((uintptr_t)memory + headerLen);
+    cache->buckets = (int32_t *)(cache->chunks + chunksCount);
+    cache->chunksCount = (int32_t)chunksCount;
+    cache->bucketsMask = (int32_t)bucketsCount - 1;
+    cache->usedChunksCount = 0;
+    cache->freeChunk = CACHE_NONE;
+    cache->untouchedChunk = 0;
+    cache->lruFirst = CACHE_NONE;
+    cache->lruLast = CACHE_NONE;
+    cache->stats.budgetBytes = chunksCount * CACHE_CHUNK_SIZE;
+    for (size_t i = 0; i < bucketsCount; i++) {
+        cache->buckets[i] = CACHE_NONE;
+    }
+    return cache;
+}
+
+QRStatus
+qr_cache_encode(QRCache *cache, const char *text, int32_t textLen, const QROptions *options, QRWorkspace *workspace,
+                QR *qr)
+{
+    return cache_encode(cache, text, textLen, options, workspace, qr, NULL, 0, NULL);
+}
+
+QRStatus
+qr_cache_encode_rendered(QRCache *cache, const char *text, int32_t textLen, const QROptions *options,
+                         QRWorkspace *workspace, QR *qr, char *buffer, size_t bufferSize, size_t *renderedSize)
+{
+    if (renderedSize == NULL) {
+        return QR_ERROR_NULL_ARGUMENT;
+    }
+    return cache_encode(cache, text, textLen, options, workspace, qr, buffer, bufferSize, renderedSize);
+}
+
+QRCacheStats
+qr_cache_stats(QRCache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    QRCacheStats stats = cache->stats;
+    stats.usedBytes = (size_t)cache->usedChunksCount * CACHE_CHUNK_SIZE;
+    pthread_mutex_unlock(&cache->lock);
+    return stats;
+}
@@ -0,0 +1,166 @@
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CLASSIFY_SIMD 1
+#endif
+
+#include "utils.h"
+#include "classify.h"
+
+#define N EM_NUMERIC
+#define A EM_ALPHANUM
+#define B EM_BYTE
+
+// Narrowest mode that can encode each byte.
+global const uint8_t CHAR_MODES[256] = {
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    A, B, B, B, A, A, B, B, B, B, A, A, B, A, A, A,
+    N, N, N, N, N, N, N, N, N, N, A, B, B, B, B, B,
+    B, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A,
+    A, A, A, A, A, A, A, A, A, A, A, B, B, B, B, B,
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+    B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+};
+
+#undef N
+#undef A
+#undef B
+
+internal void
+push_run(CharRuns *runs, int32_t offset, uint8_t mode)
+{
+    runs->offsets[runs->count] = (uint16_t)offset;
+    runs->modes[runs->count] = mode;
+    runs->count++;
+}
+
+internal void
+classify_scalar(const uint8_t *text, int32_t from, int32_t textLen, CharRuns *runs)
+{
+    uint8_t mode = runs->modes[runs->count - 1];
+    for (int32_t i = from; i < textLen; i++) {
+        if (CHAR_MODES[text[i]] != mode) {
+            mode = CHAR_MODES[text[i]];
+            push_run(runs, i, mode);
+        }
+    }
+}
+
+#if CLASSIFY_SIMD
+
+// Each kernel classifies the block at i and the block at i - 1, so a run starts wherever the two differ.
+// Classes are the encoding modes: 0 for digits, 1 for the rest of the alphanumeric set, 2 for other bytes.
+
+internal int32_t
+classify_sse2(const uint8_t *text, int32_t from, int32_t textLen, CharRuns *runs)
+{
+    int32_t i = from;
+    for (; i + 16 <= textLen; i += 16) {
+        __m128i modes[2];
+        for (int32_t k = 0; k < 2; k++) {
+            __m128i c = _mm_loadu_si128((__m128i *)(text + i - k));
+            __m128i digitOffset = _mm_sub_epi8(c, _mm_set1_epi8('0'));
+            __m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(digitOffset, _mm_set1_epi8(9)), digitOffset);
+            __m128i upperOffset = _mm_sub_epi8(c, _mm_set1_epi8('A'));
+            __m128i isAlnum = _mm_cmpeq_epi8(_mm_min_epu8(upperOffset, _mm_set1_epi8(25)), upperOffset);
+            isAlnum = _mm_or_si128(isAlnum, isDigit);
+            isAlnum = _mm_or_si128(isAlnum, _mm_cmpeq_epi8(c, _mm_set1_epi8(' ')));
+            isAlnum = _mm_or_si128(isAlnum, _mm_cmpeq_epi8(c, _mm_set1_epi8('$')));
+            isAlnum = _mm_or_si128(isAlnum, _mm_cmpeq_epi8(c, _mm_set1_epi8('%')));
+            isAlnum = _mm_or_si128(isAlnum, _mm_cmpeq_epi8(c, _mm_set1_epi8('*')));
+            isAlnum = _mm_or_si128(isAlnum, _mm_cmpeq_epi8(c, _mm_set1_epi8('+')));
+            isAlnum = _mm_or_si128(isAlnum, _mm_cmpeq_epi8(c, _mm_set1_epi8('-')));
+            isAlnum = _mm_or_si128(isAlnum, _mm_cmpeq_epi8(c, _mm_set1_epi8('.')));
+            isAlnum = _mm_or_si128(isAlnum, _mm_cmpeq_epi8(c, _mm_set1_epi8('/')));
+            isAlnum = _mm_or_si128(isAlnum, _mm_cmpeq_epi8(c, _mm_set1_epi8(':')));
+            // 2 - 1 for alphanumeric - 1 for digits
+            modes[k] = _mm_add_epi8(_mm_add_epi8(_mm_set1_epi8(2), isAlnum), isDigit);
+        }
+        uint32_t starts = (uint32_t)~_mm_movemask_epi8(_mm_cmpeq_epi8(modes[0], modes[1])) & 0xFFFF;
+        if (starts) {
+            uint8_t blockModes[16];
+            _mm_storeu_si128((__m128i *)blockModes, modes[0]);
+            for (; starts; starts &= starts - 1) {
+                int32_t k = __builtin_ctz(starts);
+                push_run(runs, i + k, blockModes[k]);
+            }
+        }
+    }
+    return i;
+}
+
+// Bytes 0x20 + n, where n is a set low nibble here, are in the alphanumeric set.
+global const uint8_t SPECIAL_LOW_NIBBLES[16] = {
+    0xFF, 0, 0, 0, 0xFF, 0xFF, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0xFF, 0xFF, 0xFF,
+};
+
+__attribute__((target("avx2"))) internal int32_t
+classify_avx2(const uint8_t *text, int32_t from, int32_t textLen, CharRuns *runs)
+{
+    __m256i specialLowNibbles = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)SPECIAL_LOW_NIBBLES));
+    int32_t i = from;
+    for (; i + 32 <= textLen; i += 32) {
+        __m256i modes[2];
+        for (int32_t k = 0; k < 2; k++) {
+            __m256i c = _mm256_loadu_si256((__m256i *)(text + i - k));
+            __m256i digitOffset = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+            __m256i isDigit = _mm256_cmpeq_epi8(_mm256_min_epu8(digitOffset, _mm256_set1_epi8(9)), digitOffset);
+            __m256i upperOffset = _mm256_sub_epi8(c, _mm256_set1_epi8('A'));
+            __m256i isAlnum = _mm256_cmpeq_epi8(_mm256_min_epu8(upperOffset, _mm256_set1_epi8(25)), upperOffset);
+            __m256i isSpecial = _mm256_and_si256(
+                _mm256_cmpeq_epi8(_mm256_and_si256(c, _mm256_set1_epi8((char)0xF0)), _mm256_set1_epi8(0x20)),
+                _mm256_shuffle_epi8(specialLowNibbles, _mm256_and_si256(c, _mm256_set1_epi8(0x0F))));
+            isAlnum = _mm256_or_si256(_mm256_or_si256(isAlnum, isDigit), isSpecial);
+            isAlnum = _mm256_or_si256(isAlnum, _mm256_cmpeq_epi8(c, _mm256_set1_epi8(':')));
+            // 2 - 1 for alphanumeric - 1 for digits
+            modes[k] = _mm256_add_epi8(_mm256_add_epi8(_mm256_set1_epi8(2), isAlnum), isDigit);
+        }
+        uint32_t starts = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(modes[0], modes[1]));
+        if (starts) {
+            uint8_t blockModes[32];
+            _mm256_storeu_si256((__m256i *)blockModes, modes[0]);
+            for (; starts; starts &= starts - 1) {
+                int32_t k = __builtin_ctz(starts);
+                push_run(runs, i + k, blockModes[k]);
+            }
+        }
+    }
+    return i;
+}
+
+#endif
+
+void
+classify_text(const char *text, int32_t textLen, CharRuns *runs)
+{
+    ASSERT(0 < textLen && textLen <= MAX_TEXT_LEN);
+
+    const uint8_t *bytes = (const uint8_t *)text;
+    runs->count = 0;
+    push_run(runs, 0, CHAR_MODES[bytes[0]]);
+
+    int32_t i = 1;
+#if CLASSIFY_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        i = classify_avx2(bytes, i, textLen, runs);
+    }
+    i = classify_sse2(bytes, i, textLen, runs);
+#endif
+    classify_scalar(bytes, i, textLen, runs);
+    runs->offsets[runs->count] = (uint16_t)textLen;
+
+    runs->mode = EM_NUMERIC;
+    for (int32_t run = 0; run < runs->count; run++) {
+        runs->mode = MAX(runs->mode, (EncodingMode)runs->modes[run]);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+
+#include <stdint.h>
+
+#include "qr.h"
+
+// Maximal runs of characters with the same narrowest encoding mode.
+typedef struct CharRuns CharRuns;
+struct CharRuns
+{
+    uint16_t offsets[MAX_TEXT_LEN + 1]; // run i spans offsets[i] to offsets[i + 1], exclusive
+    uint8_t modes[MAX_TEXT_LEN];
+    int32_t count;
+    EncodingMode mode; // widest mode of all runs
+};
+
+void classify_text(const char *text, int32_t textLen, CharRuns *runs);
+
+#endif //CLASSIFY_H
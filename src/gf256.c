@@ -1,7 +1,15 @@
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define GF256_SIMD 1
+#endif
+
 #include "utils.h"
 #include "gf256.h"
 
-global const uint8_t EXP[256] = {
+// Doubled, so EXP[LOG[a] + LOG[b]] needs no modulo.
+global const uint8_t EXP[512] = {
       1,   2,   4,   8,  16,  32,  64, 128,  29,  58, 116, 232, 205, 135,  19,  38,
      76, 152,  45,  90, 180, 117, 234, 201, 143,   3,   6,  12,  24,  48,  96, 192,
     157,  39,  78, 156,  37,  74, 148,  53, 106, 212, 181, 119, 238, 193, 159,  35,
@@ -18,6 +26,22 @@ global const uint8_t EXP[256] = {
      81, 162,  89, 178, 121, 242, 249, 239, 195, 155,  43,  86, 172,  69, 138,   9,
      18,  36,  72, 144,  61, 122, 244, 245, 247, 243, 251, 235, 203, 139,  11,  22,
      44,  88, 176, 125, 250, 233, 207, 131,  27,  54, 108, 216, 173,  71, 142,   1,
+      2,   4,   8,  16,  32,  64, 128,  29,  58, 116, 232, 205, 135,  19,  38,  76,
+    152,  45,  90, 180, 117, 234, 201, 143,   3,   6,  12,  24,  48,  96, 192, 157,
+     39,  78, 156,  37,  74, 148,  53, 106, 212, 181, 119, 238, 193, 159,  35,  70,
+    140,   5,  10,  20,  40,  80, 160,  93, 186, 105, 210, 185, 111, 222, 161,  95,
+    190,  97, 194, 153,  47,  94, 188, 101, 202, 137,  15,  30,  60, 120, 240, 253,
+    231, 211, 187, 107, 214, 177, 127, 254, 225, 223, 163,  91, 182, 113, 226, 217,
+    175,  67, 134,  17,  34,  68, 136,  13,  26,  52, 104, 208, 189, 103, 206, 129,
+     31,  62, 124, 248, 237, 199, 147,  59, 118, 236, 197, 151,  51, 102, 204, 133,
+     23,  46,  92, 184, 109, 218, 169,  79, 158,  33,  66, 132,  21,  42,  84, 168,
+     77, 154,  41,  82, 164,  85, 170,  73, 146,  57, 114, 228, 213, 183, 115, 230,
+    209, 191,  99, 198, 145,  63, 126, 252, 229, 215, 179, 123, 246, 241, 255, 227,
+    219, 171,  75, 150,  49,  98, 196, 149,  55, 110, 220, 165,  87, 174,  65, 130,
+     25,  50, 100, 200, 141,   7,  14,  28,  56, 112, 224, 221, 167,  83, 166,  81,
+    162,  89, 178, 121, 242, 249, 239, 195, 155,  43,  86, 172,  69, 138,   9,  18,
+     36,  72, 144,  61, 122, 244, 245, 247, 243, 251, 235, 203, 139,  11,  22,  44,
+     88, 176, 125, 250, 233, 207, 131,  27,  54, 108, 216, 173,  71, 142,   1,   2,
 };
 
 global const uint8_t LOG[256] = {
@@ -42,44 +66,118 @@ global const uint8_t LOG[256] = {
 uint8_t
 gf256_multiply(uint8_t a, uint8_t b)
 {
-    return (a && b) ? EXP[(LOG[a] + LOG[b]) % 255] : 0;
+    return (a && b) ? EXP[LOG[a] + LOG[b]] : 0;
 }
 
 uint8_t
 gf256_divide(uint8_t a, uint8_t b)
 {
     ASSERT(b != 0);
-    return EXP[(LOG[a] + LOG[b] * 254) % 255];
+    return a ? EXP[LOG[a] + 255 - LOG[b]] : 0;
 }
 
-int32_t
-gf256_polynom_divide(uint8_t *poly,
-                     int32_t polynomLen,
-                     uint8_t *divisor,
-                     int32_t divisorLen,
-                     uint8_t *remainder)
+void
+gf256_generator_init(GF256Generator *generator, const uint8_t *coefficients, int32_t degree)
 {
-    for (int32_t i = 0; i < polynomLen; i++) {
-        remainder[i] = poly[i];
+    ASSERT(0 < degree && degree <= GF256_MAX_GENERATOR_DEGREE);
+    ASSERT(coefficients[0] == 1);
+
+    memset(generator, 0, sizeof(*generator));
+    generator->degree = degree;
+    for (int32_t i = 0; i < degree; i++) {
+        uint8_t coefficient = coefficients[i + 1];
+        ASSERT(coefficient != 0);
+        generator->logCoefficients[i] = LOG[coefficient];
+        for (int32_t nibble = 0; nibble < 16; nibble++) {
+            generator->nibbleProducts[0][nibble][i] = gf256_multiply((uint8_t)nibble, coefficient);
+            generator->nibbleProducts[1][nibble][i] = gf256_multiply((uint8_t)(nibble << 4), coefficient);
+        }
     }
+}
 
-    int32_t index = 0;
-    uint8_t divisor0 = divisor[0];
-    for (int32_t i = divisorLen - 1; i < polynomLen; i++) {
-        uint8_t dividend = remainder[index];
-        if (dividend) {
-            uint8_t factor = gf256_divide(dividend, divisor0);
-            for (int32_t j = 0; j < divisorLen; j++) {
-                remainder[index + j] ^= gf256_multiply(factor, divisor[j]);
+// The remainder is computed as a shift register: every data byte is added to the leading register byte,
+// the register shifts by one byte and the generator multiplied by that sum is added to it.
+internal void
+rs_remainder_scalar(const GF256Generator *generator, const uint8_t *data, int32_t dataLen, uint8_t *remainder)
+{
+    int32_t degree = generator->degree;
+    const uint8_t *logCoefficients = generator->logCoefficients;
+    uint8_t reg[GF256_MAX_GENERATOR_DEGREE + 1] = {};
+    for (int32_t i = 0; i < dataLen; i++) {
+        uint8_t factor = data[i] ^ reg[0];
+        if (factor) {
+            int32_t logFactor = LOG[factor];
+            for (int32_t j = 0; j < degree; j++) {
+                reg[j] = reg[j + 1] ^ EXP[logFactor + logCoefficients[j]];
+            }
+        }
+        else {
+            for (int32_t j = 0; j < degree; j++) {
+                reg[j] = reg[j + 1];
             }
         }
-        index++;
     }
+    memcpy(remainder, reg, degree);
+}
+
+#if GF256_SIMD
+
+// The register and the nibble products are 32 bytes wide and zero past the generator degree,
+// so shifting the whole register keeps the unused bytes zero.
 
-    int32_t remainderLength = polynomLen - index;
-    for (int32_t i = index; i < polynomLen; i++) {
-        remainder[i - index] = remainder[i];
+__attribute__((target("ssse3"))) internal void
+rs_remainder_ssse3(const GF256Generator *generator, const uint8_t *data, int32_t dataLen, uint8_t *remainder)
+{
+    __m128i regLow = _mm_setzero_si128();
+    __m128i regHigh = _mm_setzero_si128();
+    for (int32_t i = 0; i < dataLen; i++) {
+        uint8_t factor = data[i] ^ (uint8_t)_mm_cvtsi128_si32(regLow);
+        const uint8_t *lowProducts = generator->nibbleProducts[0][factor & 0xF];
+        const uint8_t *highProducts = generator->nibbleProducts[1][factor >> 4];
+        regLow = _mm_alignr_epi8(regHigh, regLow, 1);
+        regHigh = _mm_srli_si128(regHigh, 1);
+        regLow = _mm_xor_si128(regLow, _mm_xor_si128(_mm_loadu_si128((__m128i *)&lowProducts[0]),
+                                                     _mm_loadu_si128((__m128i *)&highProducts[0])));
+        regHigh = _mm_xor_si128(regHigh, _mm_xor_si128(_mm_loadu_si128((__m128i *)&lowProducts[16]),
+                                                       _mm_loadu_si128((__m128i *)&highProducts[16])));
+    }
+    uint8_t reg[GF256_MAX_GENERATOR_DEGREE];
+    _mm_storeu_si128((__m128i *)&reg[0], regLow);
+    _mm_storeu_si128((__m128i *)&reg[16], regHigh);
+    memcpy(remainder, reg, generator->degree);
+}
+
+__attribute__((target("avx2"))) internal void
+rs_remainder_avx2(const GF256Generator *generator, const uint8_t *data, int32_t dataLen, uint8_t *remainder)
+{
+    __m256i reg = _mm256_setzero_si256();
+    for (int32_t i = 0; i < dataLen; i++) {
+        uint8_t factor = data[i] ^ (uint8_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(reg));
+        const uint8_t *lowProducts = generator->nibbleProducts[0][factor & 0xF];
+        const uint8_t *highProducts = generator->nibbleProducts[1][factor >> 4];
+        reg = _mm256_alignr_epi8(_mm256_permute2x128_si256(reg, reg, 0x81), reg, 1);
+        reg = _mm256_xor_si256(reg, _mm256_xor_si256(_mm256_loadu_si256((__m256i *)lowProducts),
+                                                     _mm256_loadu_si256((__m256i *)highProducts)));
     }
+    uint8_t reg8[GF256_MAX_GENERATOR_DEGREE];
+    _mm256_storeu_si256((__m256i *)reg8, reg);
+    memcpy(remainder, reg8, generator->degree);
+}
+
+#endif
 
-    return remainderLength;
+void
+gf256_rs_remainder(const GF256Generator *generator, const uint8_t *data, int32_t dataLen, uint8_t *remainder)
+{
+#if GF256_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        rs_remainder_avx2(generator, data, dataLen, remainder);
+        return;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        rs_remainder_ssse3(generator, data, dataLen, remainder);
+        return;
+    }
+#endif
+    rs_remainder_scalar(generator, data, dataLen, remainder);
 }
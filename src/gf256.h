@@ -3,12 +3,22 @@
 
 #include <stdint.h>
 
+#define GF256_MAX_GENERATOR_DEGREE 32
+
+// Reed-Solomon generator polynomial prepared for computing remainders.
+typedef struct GF256Generator GF256Generator;
+struct GF256Generator
+{
+    // nibbleProducts[0][n][i] = n * g[i + 1] and nibbleProducts[1][n][i] = (n << 4) * g[i + 1],
+    // where g is the generator without its leading 1.
+    uint8_t nibbleProducts[2][16][GF256_MAX_GENERATOR_DEGREE];
+    uint8_t logCoefficients[GF256_MAX_GENERATOR_DEGREE]; // = LOG[g[i + 1]]
+    int32_t degree;
+};
+
 uint8_t gf256_multiply(uint8_t a, uint8_t b);
 uint8_t gf256_divide(uint8_t a, uint8_t b);
-int32_t gf256_polynom_divide(uint8_t *poly,
-                             int32_t polynomLen,
-                             uint8_t *divisor,
-                             int32_t divisorLen,
-                             uint8_t *remainder);
+void gf256_generator_init(GF256Generator *generator, const uint8_t *coefficients, int32_t degree);
+void gf256_rs_remainder(const GF256Generator *generator, const uint8_t *data, int32_t dataLen, uint8_t *remainder);
 
 #endif //GF256_H
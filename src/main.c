@@ -1,13 +1,22 @@
+// MAP_ANONYMOUS and MAP_NORESERVE of mmap
+#define _DEFAULT_SOURCE
+
 #include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "utils.h"
 #include "qr.h"
+#include "batch.h"
+#include "serve.h"
+
+global QRSerial SERIAL;
+global QRProfile PROFILE;
 
 __attribute__((noreturn)) internal void
 print_usage_and_fail(char *exe)
@@ -19,7 +28,30 @@ print_usage_and_fail(char *exe)
     fprintf(stderr, "    -l LEVEL   Force error correction level, where VERSION is a number from 0 (Low) to 3 (High).\n");
     fprintf(stderr, "    -v VERSION Force QR version, where VERSION is a number from 1 to 40.\n");
     fprintf(stderr, "    -m MASK    Force mask pattern, where MASK is a number from 0 to 7.\n");
-    fprintf(stderr, "    -o FORMAT  Output format, where FORMAT is one of: ANSI, ASCII, UTF8, UTF8Q. Defaults to UTF8.\n");
+    fprintf(stderr, "    -e MODE    Encode the text as a single segment in MODE, one of: NUMERIC, ALPHANUMERIC, BYTE.\n");
+    fprintf(stderr, "               Requires -l, -v and -m, which then skip the analysis and the mask search.\n");
+    fprintf(stderr, "    -o FORMAT  Output format, where FORMAT is one of: ANSI, ASCII, UTF8, UTF8Q,\n");
+    fprintf(stderr, "               ANSI_RLE, ANSI_RGB, ANSI_HALF, PBM, PGM, PNG, PNG_STORED,\n");
+    fprintf(stderr, "               SVG, SVG_CRISP. Defaults to UTF8.\n");
+    fprintf(stderr, "    -x SCALE   Pixels per module of images, from %d to %d. Defaults to %d.\n", MIN_SCALE, MAX_SCALE, MIN_SCALE);
+    fprintf(stderr, "    -q QUIET   Width of the quiet zone in modules, from 0 to %d. Defaults to %d.\n", MAX_QUIET_ZONE, DEFAULT_QUIET_ZONE);
+    fprintf(stderr, "    -s SEARCH  Mask search, where SEARCH is one of: SEQUENTIAL, PARALLEL, BOUNDED.\n");
+    fprintf(stderr, "               Defaults to PARALLEL on multi-core machines and SEQUENTIAL otherwise.\n");
+    fprintf(stderr, "    -b FRAMING Encode every record of the input, where FRAMING is one of: LINE, NUL, LENGTH.\n");
+    fprintf(stderr, "               LENGTH records start with their length as a 32-bit big-endian integer.\n");
+    fprintf(stderr, "    -p         With -b, every record starts with its own options and a tab, e.g. l=3,v=10,m=2,o=ASCII.\n");
+    fprintf(stderr, "               x=SCALE and q=QUIET are accepted too.\n");
+    fprintf(stderr, "    -r SEP     With -b or -n, print SEP between the symbols, where SEP may contain \\n, \\t, \\0\n");
+    fprintf(stderr, "               and \\\\. Defaults to \\n.\n");
+    fprintf(stderr, "    -n COUNT   Encode COUNT serial numbers, counting up from the last run of digits in the text,\n");
+    fprintf(stderr, "               which keeps its width. All symbols take the version, level and mask of the first.\n");
+    fprintf(stderr, "    -S SOCKET  Serve encoding requests on the Unix domain socket SOCKET, see src/serve.h.\n");
+    fprintf(stderr, "               Cannot be combined with -t, -f, -b or -n.\n");
+    fprintf(stderr, "    -j JOBS    With -b or -S, encode on JOBS threads, from 1 to %d.\n", BATCH_MAX_JOBS);
+    fprintf(stderr, "               Defaults to 1 with -b and to the number of cores with -S.\n");
+    fprintf(stderr, "               More than one job makes the mask search SEQUENTIAL unless -s is given.\n");
+    fprintf(stderr, "    -c MIB     With -b or -S, cache up to MIB mebibytes of symbols,\n");
+    fprintf(stderr, "               so repeated texts skip encoding. -S caches their renderings too.\n");
     fprintf(stderr, "    -d         Print debugging messages to STDERR.\n");
     fprintf(stderr, "If neither -t nor -f is specified, encodes the data read from STDIN.\n");
     exit(1);
@@ -28,32 +60,114 @@ print_usage_and_fail(char *exe)
 internal OutputFormat
 parse_output_format(char *exe, char *outputFormatString)
 {
-    if (strcmp(outputFormatString, "ANSI") == 0) {
-        return OF_ANSI;
+    for (OutputFormat outputFormat = 0; outputFormat < OF_COUNT; outputFormat++) {
+        if (strcmp(outputFormatString, OutputFormatNames[outputFormat]) == 0) {
+            return outputFormat;
+        }
+    }
+    fprintf(stderr, "Invalid output format: %s\n", outputFormatString);
+    print_usage_and_fail(exe);
+}
+
+internal EncodingMode
+parse_encoding_mode(char *exe, char *modeString)
+{
+    for (EncodingMode mode = 0; mode < EM_COUNT; mode++) {
+        if (strcmp(modeString, EncodingModeNames[mode]) == 0) {
+            return mode;
+        }
     }
-    if (strcmp(outputFormatString, "ASCII") == 0) {
-        return OF_ASCII;
+    fprintf(stderr, "Invalid encoding mode: %s\n", modeString);
+    print_usage_and_fail(exe);
+}
+
+internal MaskSearch
+parse_mask_search(char *exe, char *maskSearchString)
+{
+    if (strcmp(maskSearchString, "SEQUENTIAL") == 0) {
+        return MS_SEQUENTIAL;
     }
-    if (strcmp(outputFormatString, "UTF8") == 0) {
-        return OF_UTF8;
+    if (strcmp(maskSearchString, "PARALLEL") == 0) {
+        return MS_PARALLEL;
     }
-    if (strcmp(outputFormatString, "UTF8Q") == 0) {
-        return OF_UTF8Q;
+    if (strcmp(maskSearchString, "BOUNDED") == 0) {
+        return MS_BOUNDED;
     }
-    fprintf(stderr, "Invalid output format: %s\n", outputFormatString);
+    fprintf(stderr, "Invalid mask search: %s\n", maskSearchString);
+    print_usage_and_fail(exe);
+}
+
+internal BatchFraming
+parse_batch_framing(char *exe, char *framingString)
+{
+    for (BatchFraming framing = 0; framing < BF_COUNT; framing++) {
+        if (strcmp(framingString, BatchFramingNames[framing]) == 0) {
+            return framing;
+        }
+    }
+    fprintf(stderr, "Invalid framing: %s\n", framingString);
     print_usage_and_fail(exe);
 }
 
+internal void
+parse_separator(char *exe, char *separatorString, BatchOptions *batch)
+{
+    batch->separatorLen = 0;
+    for (char *ch = separatorString; *ch != '\0'; ch++) {
+        if (batch->separatorLen == BATCH_MAX_SEPARATOR_LEN) {
+            fprintf(stderr, "Separator exceeds the maximum length of %d characters\n", BATCH_MAX_SEPARATOR_LEN);
+            print_usage_and_fail(exe);
+        }
+        char value = *ch;
+        if (value == '\\') {
+            switch (*++ch) {
+                case 'n': value = '\n'; break;
+                case 't': value = '\t'; break;
+                case '0': value = '\0'; break;
+                case '\\': value = '\\'; break;
+                default: {
+                    fprintf(stderr, "Invalid separator: %s\n", separatorString);
+                    print_usage_and_fail(exe);
+                }
+            }
+        }
+        batch->separator[batch->separatorLen++] = value;
+    }
+}
+
+// Reads the text to encode into input, unless in batch mode.
 internal QROptions
-parse_options(int32_t argc, char **argv)
+parse_options(int32_t argc, char **argv, char *input, int32_t *inputLen, int64_t *serialsCount, BatchOptions *batch,
+              ServeOptions *serve)
 {
     QROptions options = {};
     options.forcedLevel = LEVEL_INVALID;
     options.forcedVersion = VERSION_INVALID;
     options.forcedMask = MASK_INVALID;
-    options.outputFormat = OF_UTF8;
+    options.maskSearch = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? MS_PARALLEL : MS_SEQUENTIAL;
+    options.render.format = OF_UTF8;
+    options.render.scale = MIN_SCALE;
+    options.render.quietZone = DEFAULT_QUIET_ZONE;
     options.isDebug = false;
 
+    batch->isEnabled = false;
+    batch->framing = BF_LINE;
+    batch->hasRecordOptions = false;
+    batch->separator[0] = '\n';
+    batch->separatorLen = 1;
+    batch->filepath = NULL;
+    batch->jobsCount = 1;
+    batch->cache = NULL;
+    batch->profile = NULL;
+    serve->isEnabled = false;
+    serve->socketPath = NULL;
+    serve->cache = NULL;
+    *serialsCount = 0;
+    EncodingMode forcedMode = EM_COUNT;
+    size_t cacheMiB = 0;
+    bool isMaskSearchForced = false;
+    bool isJobsCountForced = false;
+
     char *exe = argv[0];
     char *text = NULL;
     char *filepath = NULL;
@@ -126,13 +240,124 @@ parse_options(int32_t argc, char **argv)
                 }
                 options.forcedMask = (int32_t)mask;
             } break;
+            case 'e': {
+                if (++i >= argc) {
+                    fprintf(stderr, "Missing MODE\n");
+                    print_usage_and_fail(exe);
+                }
+                char *modeString = argv[i];
+                forcedMode = parse_encoding_mode(exe, modeString);
+            } break;
             case 'o': {
                 if (++i >= argc) {
                     fprintf(stderr, "Missing FORMAT\n");
                     print_usage_and_fail(exe);
                 }
                 char *outputFormatString = argv[i];
-                options.outputFormat = parse_output_format(exe, outputFormatString);
+                options.render.format = parse_output_format(exe, outputFormatString);
+            } break;
+            case 'x': {
+                if (++i >= argc) {
+                    fprintf(stderr, "Missing SCALE\n");
+                    print_usage_and_fail(exe);
+                }
+                char *scaleString = argv[i];
+                intmax_t scale = strtoimax(scaleString, NULL, 10);
+                if (scale < MIN_SCALE || scale > MAX_SCALE) {
+                    fprintf(stderr, "Invalid scale: %s\n", scaleString);
+                    print_usage_and_fail(exe);
+                }
+                options.render.scale = (int32_t)scale;
+            } break;
+            case 'q': {
+                if (++i >= argc) {
+                    fprintf(stderr, "Missing QUIET\n");
+                    print_usage_and_fail(exe);
+                }
+                char *quietZoneString = argv[i];
+                intmax_t quietZone = strtoimax(quietZoneString, NULL, 10);
+                if (quietZone < 0 || quietZone > MAX_QUIET_ZONE) {
+                    fprintf(stderr, "Invalid quiet zone: %s\n", quietZoneString);
+                    print_usage_and_fail(exe);
+                }
+                options.render.quietZone = (int32_t)quietZone;
+            } break;
+            case 's': {
+                if (++i >= argc) {
+                    fprintf(stderr, "Missing SEARCH\n");
+                    print_usage_and_fail(exe);
+                }
+                char *maskSearchString = argv[i];
+                options.maskSearch = parse_mask_search(exe, maskSearchString);
+                isMaskSearchForced = true;
+            } break;
+            case 'b': {
+                if (++i >= argc) {
+                    fprintf(stderr, "Missing FRAMING\n");
+                    print_usage_and_fail(exe);
+                }
+                char *framingString = argv[i];
+                batch->isEnabled = true;
+                batch->framing = parse_batch_framing(exe, framingString);
+            } break;
+            case 'p': {
+                batch->hasRecordOptions = true;
+            } break;
+            case 'r': {
+                if (++i >= argc) {
+                    fprintf(stderr, "Missing SEP\n");
+                    print_usage_and_fail(exe);
+                }
+                char *separatorString = argv[i];
+                parse_separator(exe, separatorString, batch);
+            } break;
+            case 'j': {
+                if (++i >= argc) {
+                    fprintf(stderr, "Missing JOBS\n");
+                    print_usage_and_fail(exe);
+                }
+                char *jobsString = argv[i];
+                intmax_t jobsCount = strtoimax(jobsString, NULL, 10);
+                if (jobsCount < 1 || jobsCount > BATCH_MAX_JOBS) {
+                    fprintf(stderr, "Invalid jobs count: %s\n", jobsString);
+                    print_usage_and_fail(exe);
+                }
+                batch->jobsCount = (int32_t)jobsCount;
+                isJobsCountForced = true;
+            } break;
+            case 'n': {
+                if (++i >= argc) {
+                    fprintf(stderr, "Missing COUNT\n");
+                    print_usage_and_fail(exe);
+                }
+                char *countString = argv[i];
+                intmax_t count = strtoimax(countString, NULL, 10);
+                if (count < 1) {
+                    fprintf(stderr, "Invalid serial numbers count: %s\n", countString);
+                    print_usage_and_fail(exe);
+                }
+                *serialsCount = (int64_t)count;
+            } break;
+            case 'S': {
+                if (++i >= argc) {
+                    fprintf(stderr, "Missing SOCKET\n");
+                    print_usage_and_fail(exe);
+                }
+                serve->isEnabled = true;
+                serve->socketPath = argv[i];
+            } break;
+            case 'c': {
+                if (++i >= argc) {
+                    fprintf(stderr, "Missing MIB\n");
+                    print_usage_and_fail(exe);
+                }
+                char *cacheString = argv[i];
+                intmax_t cacheMiBValue = strtoimax(cacheString, NULL, 10);
+                if (cacheMiBValue < 1 || (uintmax_t)cacheMiBValue > SIZE_MAX >> 20) {
+                    fprintf(stderr, "Invalid cache size: %s\n", cacheString);
+                    print_usage_and_fail(exe);
+                }
+                cacheMiB = (size_t)cacheMiBValue;
             } break;
             case 'd': {
                 options.isDebug = true;
@@ -144,10 +369,85 @@ parse_options(int32_t argc, char **argv)
         }
     }
 
+    if (forcedMode != EM_COUNT) {
+        if (options.forcedLevel == LEVEL_INVALID || options.forcedVersion == VERSION_INVALID
+            || options.forcedMask == MASK_INVALID) {
+            fprintf(stderr, "-e requires -l, -v and -m\n");
+            print_usage_and_fail(exe);
+        }
+        if (batch->hasRecordOptions || serve->isEnabled || *serialsCount > 0 || cacheMiB > 0) {
+            fprintf(stderr, "-e cannot be combined with -p, -S, -n or -c\n");
+            print_usage_and_fail(exe);
+        }
+        QRStatus status = qr_profile_init(&PROFILE, forcedMode, options.forcedVersion, options.forcedLevel,
+                                          options.forcedMask);
+        if (status != QR_OK) {
+            fprintf(stderr, "Failed to pin the options: %s\n", qr_status_message(status));
+            exit(1);
+        }
+        batch->profile = &PROFILE;
+    }
+    if (cacheMiB > 0) {
+        if (!batch->isEnabled && !serve->isEnabled) {
+            fprintf(stderr, "-c requires -b or -S\n");
+            print_usage_and_fail(exe);
+        }
+        // Only the pages the cache fills are ever touched.
+        void *cacheMemory = mmap(NULL, cacheMiB << 20, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                 -1, 0);
+        if (cacheMemory == MAP_FAILED) {
+            fprintf(stderr, "Failed to allocate %zu MiB for the cache: %s\n", cacheMiB, strerror(errno));
+            exit(1);
+        }
+        QRCache *cache = qr_cache_init(cacheMemory, cacheMiB << 20);
+        batch->cache = cache;
+        serve->cache = cache;
+    }
+    if (serve->isEnabled) {
+        if (text != NULL || filepath != NULL || batch->isEnabled || *serialsCount > 0) {
+            fprintf(stderr, "-S cannot be combined with -t, -f, -b or -n\n");
+            print_usage_and_fail(exe);
+        }
+        if (batch->hasRecordOptions) {
+            fprintf(stderr, "-p requires -b\n");
+            print_usage_and_fail(exe);
+        }
+        serve->jobsCount = isJobsCountForced ? batch->jobsCount : (int32_t)MIN(sysconf(_SC_NPROCESSORS_ONLN), BATCH_MAX_JOBS);
+        if (serve->jobsCount > 1 && !isMaskSearchForced) {
+            options.maskSearch = MS_SEQUENTIAL;
+        }
+        return options;
+    }
+    if (batch->isEnabled) {
+        if (text != NULL || *serialsCount > 0) {
+            fprintf(stderr, "-b cannot be combined with -t or -n\n");
+            print_usage_and_fail(exe);
+        }
+        if (batch->jobsCount > 1 && !isMaskSearchForced) {
+            // The jobs already keep the cores busy.
+            options.maskSearch = MS_SEQUENTIAL;
+        }
+        // Records are read by batch_run.
+        batch->filepath = filepath;
+        return options;
+    }
+    if (batch->hasRecordOptions) {
+        fprintf(stderr, "-p requires -b\n");
+        print_usage_and_fail(exe);
+    }
+    if (batch->jobsCount > 1) {
+        fprintf(stderr, "-j requires -b or -S\n");
+        print_usage_and_fail(exe);
+    }
+
     if (text != NULL) {
         size_t textLen = strlen(text);
-        strncpy(options.text, text, textLen);
-        options.textLen = (int32_t)textLen;
+        if (textLen > MAX_TEXT_LEN) {
+            fprintf(stderr, "Text exceeds the maximum length of %d characters\n", MAX_TEXT_LEN);
+            exit(1);
+        }
+        memcpy(input, text, textLen);
+        *inputLen = (int32_t)textLen;
     }
     else if (filepath != NULL) {
         FILE *file = fopen(filepath, "r");
@@ -155,7 +455,7 @@ parse_options(int32_t argc, char **argv)
             fprintf(stderr, "Failed to open file '%s': %s\n", filepath, strerror(errno));
             exit(1);
         }
-        size_t fileSize = fread(options.text, sizeof(options.text[0]), MAX_TEXT_LEN + 1, file);
+        size_t fileSize = fread(input, sizeof(input[0]), MAX_TEXT_LEN + 1, file);
         if (ferror(file) != 0) {
             fprintf(stderr, "Failed to read from file '%s': %s\n", filepath, strerror(errno));
             exit(1);
@@ -165,15 +465,14 @@ parse_options(int32_t argc, char **argv)
             exit(1);
         }
         fclose(file);
-        options.text[fileSize] = '\0';
-        options.textLen = (int32_t)fileSize;
+        *inputLen = (int32_t)fileSize;
     }
     else {
         if (isatty(STDIN_FILENO)) {
             printf("Enter text to encode (Ctrl+D to finish): ");
             fflush(stdout);
         }
-        size_t inputSize = fread(options.text, sizeof(options.text[0]), MAX_TEXT_LEN + 1, stdin);
+        size_t inputSize = fread(input, sizeof(input[0]), MAX_TEXT_LEN + 1, stdin);
         if (ferror(stdin) != 0) {
             fprintf(stderr, "Failed to read from STDIN: %s\n", strerror(errno));
             exit(1);
@@ -182,20 +481,85 @@ parse_options(int32_t argc, char **argv)
             fprintf(stderr, "Input exceeds the maximum length of %d characters\n", MAX_TEXT_LEN);
             exit(1);
         }
-        options.text[inputSize] = '\0';
-        options.textLen = (int32_t)inputSize;
+        *inputLen = (int32_t)inputSize;
     }
 
-    ASSERT(options.textLen > 0);
-
     return options;
 }
 
+// Prints count symbols of input with its last run of digits counting up, at most MAX_SERIAL_WIDTH of them.
+internal void
+print_serials(char *input, int32_t inputLen, int64_t count, QROptions *options, BatchOptions *batch)
+{
+    int32_t counterEnd = inputLen;
+    while (counterEnd > 0 && (input[counterEnd - 1] < '0' || input[counterEnd - 1] > '9')) {
+        counterEnd--;
+    }
+    int32_t counterOffset = counterEnd;
+    while (counterOffset > 0 && counterEnd - counterOffset < MAX_SERIAL_WIDTH
+           && input[counterOffset - 1] >= '0' && input[counterOffset - 1] <= '9') {
+        counterOffset--;
+    }
+    int32_t counterWidth = counterEnd - counterOffset;
+    if (counterWidth == 0) {
+        fprintf(stderr, "-n requires a number in the text to count up from\n");
+        exit(1);
+    }
+    int64_t first = 0;
+    int64_t countersCount = 1;
+    for (int32_t i = counterOffset; i < counterEnd; i++) {
+        first = first * 10 + (input[i] - '0');
+        countersCount *= 10;
+    }
+    if (count > countersCount - first) {
+        fprintf(stderr, "Serial numbers exceed the %d digits of the counter\n", counterWidth);
+        exit(1);
+    }
+
+    QRWorkspace workspace;
+    QRStatus status = qr_serial_init(&SERIAL, input, inputLen, counterOffset, counterWidth, options, &workspace);
+    if (status != QR_OK) {
+        fprintf(stderr, "Failed to encode: %s\n", qr_status_message(status));
+        exit(1);
+    }
+    QR qr;
+    for (int64_t i = 0; i < count; i++) {
+        if (i > 0) {
+            fwrite(batch->separator, 1, batch->separatorLen, stdout);
+        }
+        qr_serial_encode(&SERIAL, first + i, &qr);
+        qr_print(stdout, &qr, &options->render);
+    }
+}
+
 int32_t
 main(int32_t argc, char **argv)
 {
-    QROptions options = parse_options(argc, argv);
-    QR qr = qr_encode(&options);
-    qr_print(stdout, &qr, options.outputFormat);
+    BatchOptions batch;
+    ServeOptions serve;
+    char input[MAX_TEXT_LEN + 1];
+    int32_t inputLen = 0;
+    int64_t serialsCount = 0;
+    QROptions options = parse_options(argc, argv, input, &inputLen, &serialsCount, &batch, &serve);
+    if (serve.isEnabled) {
+        serve_run(&options, &serve);
+    }
+    if (batch.isEnabled) {
+        batch_run(&options, &batch);
+        return 0;
+    }
+    if (serialsCount > 0) {
+        print_serials(input, inputLen, serialsCount, &options, &batch);
+        return 0;
+    }
+    QRWorkspace workspace;
+    QR qr;
+    QRStatus status = (batch.profile != NULL) ? qr_profile_encode(batch.profile, input, inputLen, &workspace, &qr)
+                                              : qr_encode(input, inputLen, &options, &workspace, &qr);
+    if (status != QR_OK) {
+        fprintf(stderr, "Failed to encode: %s\n", qr_status_message(status));
+        return 1;
+    }
+    qr_print(stdout, &qr, &options.render);
     return 0;
 }
@@ -0,0 +1,225 @@
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define PACK_SIMD 1
+#endif
+
+#include "utils.h"
+#include "pack.h"
+
+#define XX 0xFF
+
+// Base-45 value of each byte of the alphanumeric set, 0xFF elsewhere.
+global const uint8_t ALNUM_VALUES[256] = {
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+     36,  XX,  XX,  XX,  37,  38,  XX,  XX,  XX,  XX,  39,  40,  XX,  41,  42,  43,
+      0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  44,  XX,  XX,  XX,  XX,  XX,
+     XX,  10,  11,  12,  13,  14,  15,  16,  17,  18,  19,  20,  21,  22,  23,  24,
+     25,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  XX,  XX,  XX,  XX,  XX,
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+     XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,  XX,
+};
+
+#undef XX
+
+// Appends 10-bit groups of three digits, six to a write.
+internal void
+append_numeric_triples(BitVec *bv, const uint32_t *triples, int32_t triplesCount)
+{
+    for (int32_t i = 0; i < triplesCount; i += 6) {
+        int32_t count = MIN(triplesCount - i, 6);
+        uint64_t bits = 0;
+        for (int32_t k = 0; k < count; k++) {
+            bits = (bits << 10) | triples[i + k];
+        }
+        bv_append(bv, bits, count * 10);
+    }
+}
+
+// Appends 11-bit alphanumeric pairs, five to a write.
+internal void
+append_alnum_pairs(BitVec *bv, const uint16_t *pairs, int32_t pairsCount)
+{
+    for (int32_t i = 0; i < pairsCount; i += 5) {
+        int32_t count = MIN(pairsCount - i, 5);
+        uint64_t bits = 0;
+        for (int32_t k = 0; k < count; k++) {
+            bits = (bits << 11) | pairs[i + k];
+        }
+        bv_append(bv, bits, count * 11);
+    }
+}
+
+#if PACK_SIMD
+
+// Both numeric kernels convert four digit triples per 128-bit lane: the shuffle spreads each triple over
+// four bytes (zero last), the byte multiply-add forms 100 * d0 + 10 * d1 and d2, the word one sums them.
+
+global const int8_t TRIPLE_SHUFFLE[16] = {
+    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+};
+global const int8_t TRIPLE_WEIGHTS[16] = {
+    100, 10, 1, 0, 100, 10, 1, 0, 100, 10, 1, 0, 100, 10, 1, 0,
+};
+
+__attribute__((target("ssse3"))) internal int32_t
+pack_numeric_ssse3(BitVec *bv, const uint8_t *digits, int32_t digitsCount)
+{
+    __m128i shuffle = _mm_loadu_si128((__m128i *)TRIPLE_SHUFFLE);
+    __m128i weights = _mm_loadu_si128((__m128i *)TRIPLE_WEIGHTS);
+    int32_t i = 0;
+    for (; i + 16 <= digitsCount; i += 12) {
+        __m128i values = _mm_sub_epi8(_mm_loadu_si128((__m128i *)(digits + i)), _mm_set1_epi8('0'));
+        values = _mm_shuffle_epi8(values, shuffle);
+        __m128i groups = _mm_madd_epi16(_mm_maddubs_epi16(values, weights), _mm_set1_epi16(1));
+        uint32_t blockGroups[4];
+        _mm_storeu_si128((__m128i *)blockGroups, groups);
+        append_numeric_triples(bv, blockGroups, 4);
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) internal int32_t
+pack_numeric_avx2(BitVec *bv, const uint8_t *digits, int32_t digitsCount)
+{
+    __m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)TRIPLE_SHUFFLE));
+    __m256i weights = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)TRIPLE_WEIGHTS));
+    int32_t i = 0;
+    for (; i + 28 <= digitsCount; i += 24) {
+        __m256i values = _mm256_loadu2_m128i((__m128i *)(digits + i + 12), (__m128i *)(digits + i));
+        values = _mm256_sub_epi8(values, _mm256_set1_epi8('0'));
+        values = _mm256_shuffle_epi8(values, shuffle);
+        __m256i groups = _mm256_madd_epi16(_mm256_maddubs_epi16(values, weights), _mm256_set1_epi16(1));
+        uint32_t blockGroups[8];
+        _mm256_storeu_si256((__m256i *)blockGroups, groups);
+        append_numeric_triples(bv, blockGroups, 8);
+    }
+    return i;
+}
+
+// Both alphanumeric kernels look the characters up in the 0x20-0x5F slice of ALNUM_VALUES, one 16-byte row
+// per high nibble, then pair them with a byte multiply-add by 45 and 1.
+
+__attribute__((target("ssse3"))) internal int32_t
+pack_alnum_ssse3(BitVec *bv, const uint8_t *chars, int32_t charsCount)
+{
+    __m128i weights = _mm_set1_epi16(45 | (1 << 8));
+    int32_t i = 0;
+    for (; i + 16 <= charsCount; i += 16) {
+        __m128i c = _mm_loadu_si128((__m128i *)(chars + i));
+        __m128i lowNibbles = _mm_and_si128(c, _mm_set1_epi8(0x0F));
+        __m128i highNibbles = _mm_and_si128(_mm_srli_epi16(c, 4), _mm_set1_epi8(0x0F));
+        __m128i values = _mm_setzero_si128();
+        for (int32_t row = 2; row <= 5; row++) {
+            __m128i table = _mm_loadu_si128((__m128i *)&ALNUM_VALUES[row * 16]);
+            __m128i isRow = _mm_cmpeq_epi8(highNibbles, _mm_set1_epi8((char)row));
+            values = _mm_or_si128(values, _mm_and_si128(_mm_shuffle_epi8(table, lowNibbles), isRow));
+        }
+        uint16_t pairs[8];
+        _mm_storeu_si128((__m128i *)pairs, _mm_maddubs_epi16(values, weights));
+        append_alnum_pairs(bv, pairs, 8);
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) internal int32_t
+pack_alnum_avx2(BitVec *bv, const uint8_t *chars, int32_t charsCount)
+{
+    __m256i weights = _mm256_set1_epi16(45 | (1 << 8));
+    int32_t i = 0;
+    for (; i + 32 <= charsCount; i += 32) {
+        __m256i c = _mm256_loadu_si256((__m256i *)(chars + i));
+        __m256i lowNibbles = _mm256_and_si256(c, _mm256_set1_epi8(0x0F));
+        __m256i highNibbles = _mm256_and_si256(_mm256_srli_epi16(c, 4), _mm256_set1_epi8(0x0F));
+        __m256i values = _mm256_setzero_si256();
+        for (int32_t row = 2; row <= 5; row++) {
+            __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)&ALNUM_VALUES[row * 16]));
+            __m256i isRow = _mm256_cmpeq_epi8(highNibbles, _mm256_set1_epi8((char)row));
+            values = _mm256_or_si256(values, _mm256_and_si256(_mm256_shuffle_epi8(table, lowNibbles), isRow));
+        }
+        uint16_t pairs[16];
+        _mm256_storeu_si256((__m256i *)pairs, _mm256_maddubs_epi16(values, weights));
+        append_alnum_pairs(bv, pairs, 16);
+    }
+    return i;
+}
+
+#endif
+
+void
+pack_numeric(BitVec *bv, const char *text, int32_t textLen)
+{
+    const uint8_t *digits = (const uint8_t *)text;
+    int32_t i = 0;
+#if PACK_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        i = pack_numeric_avx2(bv, digits, textLen);
+    }
+    else if (__builtin_cpu_supports("ssse3")) {
+        i = pack_numeric_ssse3(bv, digits, textLen);
+    }
+#endif
+    uint32_t triples[6];
+    int32_t triplesCount = 0;
+    for (; i + 3 <= textLen; i += 3) {
+        ASSERT(digits[i] >= '0' && digits[i] <= '9' && digits[i + 1] >= '0' && digits[i + 1] <= '9'
+               && digits[i + 2] >= '0' && digits[i + 2] <= '9');
+        triples[triplesCount++] = (uint32_t)(digits[i] - '0') * 100 + (uint32_t)(digits[i + 1] - '0') * 10
+            + (uint32_t)(digits[i + 2] - '0');
+        if (triplesCount == ARRAY_CAP(triples)) {
+            append_numeric_triples(bv, triples, triplesCount);
+            triplesCount = 0;
+        }
+    }
+    append_numeric_triples(bv, triples, triplesCount);
+
+    // A trailing group of one or two digits takes 4 or 7 bits, whatever its value.
+    uint32_t group = 0;
+    for (int32_t k = i; k < textLen; k++) {
+        ASSERT(digits[k] >= '0' && digits[k] <= '9');
+        group = group * 10 + (uint32_t)(digits[k] - '0');
+    }
+    if (i < textLen) {
+        bv_append(bv, group, (textLen - i == 2) ? 7 : 4);
+    }
+}
+
+void
+pack_alphanum(BitVec *bv, const char *text, int32_t textLen)
+{
+    const uint8_t *chars = (const uint8_t *)text;
+    int32_t i = 0;
+#if PACK_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        i = pack_alnum_avx2(bv, chars, textLen);
+    }
+    else if (__builtin_cpu_supports("ssse3")) {
+        i = pack_alnum_ssse3(bv, chars, textLen);
+    }
+#endif
+    for (; i + 2 <= textLen; i += 2) {
+        ASSERT(ALNUM_VALUES[chars[i]] != 0xFF && ALNUM_VALUES[chars[i + 1]] != 0xFF);
+        bv_append(bv, ALNUM_VALUES[chars[i]] * 45U + ALNUM_VALUES[chars[i + 1]], 11);
+    }
+    if (i < textLen) {
+        ASSERT(ALNUM_VALUES[chars[i]] != 0xFF);
+        bv_append(bv, ALNUM_VALUES[chars[i]], 6);
+    }
+}
+
+uint32_t
+pack_alnum_value(char ch)
+{
+    ASSERT(ALNUM_VALUES[(uint8_t)ch] != 0xFF);
+    return ALNUM_VALUES[(uint8_t)ch];
+}
@@ -0,0 +1,14 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+
+#include "bv.h"
+
+// Append the data bits of a numeric or alphanumeric segment, without its mode indicator and character count.
+void pack_numeric(BitVec *bv, const char *text, int32_t textLen);
+void pack_alphanum(BitVec *bv, const char *text, int32_t textLen);
+// Base-45 value of an alphanumeric character.
+uint32_t pack_alnum_value(char ch);
+
+#endif //PACK_H
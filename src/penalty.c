@@ -0,0 +1,384 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define PENALTY_AVX2 1
+#endif
+
+#include "utils.h"
+#include "penalty.h"
+
+typedef struct BitRow BitRow;
+struct BitRow
+{
+    uint64_t words[PENALTY_ROW_WORDS];
+};
+
+internal BitRow
+row_load(uint64_t *words)
+{
+    BitRow r;
+    memcpy(r.words, words, sizeof(r.words));
+    return r;
+}
+
+internal BitRow
+row_first_bits(int32_t bitsCount)
+{
+    BitRow r = {};
+    for (int32_t i = 0; i < PENALTY_ROW_WORDS; i++) {
+        int32_t bits = MIN(MAX(bitsCount - 64 * i, 0), 64);
+        r.words[i] = (bits == 64) ? ~0ULL : ((1ULL << bits) - 1);
+    }
+    return r;
+}
+
+internal BitRow
+row_and(BitRow a, BitRow b)
+{
+    BitRow r;
+    for (int32_t i = 0; i < PENALTY_ROW_WORDS; i++) {
+        r.words[i] = a.words[i] & b.words[i];
+    }
+    return r;
+}
+
+// = ~a & b
+internal BitRow
+row_andnot(BitRow a, BitRow b)
+{
+    BitRow r;
+    for (int32_t i = 0; i < PENALTY_ROW_WORDS; i++) {
+        r.words[i] = ~a.words[i] & b.words[i];
+    }
+    return r;
+}
+
+internal BitRow
+row_xor(BitRow a, BitRow b)
+{
+    BitRow r;
+    for (int32_t i = 0; i < PENALTY_ROW_WORDS; i++) {
+        r.words[i] = a.words[i] ^ b.words[i];
+    }
+    return r;
+}
+
+// Moves module (column + k) into column, 0 < k < 64.
+internal BitRow
+row_shr(BitRow a, int32_t k)
+{
+    BitRow r;
+    for (int32_t i = 0; i < PENALTY_ROW_WORDS - 1; i++) {
+        r.words[i] = (a.words[i] >> k) | (a.words[i + 1] << (64 - k));
+    }
+    r.words[PENALTY_ROW_WORDS - 1] = a.words[PENALTY_ROW_WORDS - 1] >> k;
+    return r;
+}
+
+// Moves module (column - k) into column, 0 < k < 64.
+internal BitRow
+row_shl(BitRow a, int32_t k)
+{
+    BitRow r;
+    for (int32_t i = PENALTY_ROW_WORDS - 1; i > 0; i--) {
+        r.words[i] = (a.words[i] << k) | (a.words[i - 1] >> (64 - k));
+    }
+    r.words[0] = a.words[0] << k;
+    return r;
+}
+
+internal int32_t
+row_popcount(BitRow a)
+{
+    int32_t count = 0;
+    for (int32_t i = 0; i < PENALTY_ROW_WORDS; i++) {
+        count += __builtin_popcountll(a.words[i]);
+    }
+    return count;
+}
+
+// Runs of 5+ same-colored modules score 3 + (runLength - 5), that is one point for every
+// 5-module window inside the run plus 2 points for the run itself.
+internal int32_t
+calc_rule1_line(BitRow line, BitRow pairsMask)
+{
+    BitRow equal = row_andnot(row_xor(line, row_shr(line, 1)), pairsMask);
+    BitRow windows = row_and(row_and(equal, row_shr(equal, 1)), row_and(row_shr(equal, 2), row_shr(equal, 3)));
+    BitRow runs = row_andnot(row_shl(windows, 1), windows);
+    return row_popcount(windows) + 2 * row_popcount(runs);
+}
+
+// Dark-light-dark-dark-dark-light-dark with 4 light modules on either side scores 40 per side.
+internal int32_t
+calc_rule3_line(BitRow line, BitRow lineMask)
+{
+    BitRow light = row_andnot(line, lineMask);
+    BitRow pattern = row_and(row_and(row_and(line, row_shr(light, 1)), row_and(row_shr(line, 2), row_shr(line, 3))),
+                             row_and(row_and(row_shr(line, 4), row_shr(light, 5)), row_shr(line, 6)));
+    BitRow lightBefore = row_and(row_and(row_shl(light, 1), row_shl(light, 2)), row_and(row_shl(light, 3), row_shl(light, 4)));
+    BitRow lightAfter = row_and(row_and(row_shr(light, 7), row_shr(light, 8)), row_and(row_shr(light, 9), row_shr(light, 10)));
+    return 40 * (row_popcount(row_and(pattern, lightBefore)) + row_popcount(row_and(pattern, lightAfter)));
+}
+
+internal int32_t
+calc_rule1_lines(uint64_t (*lines)[PENALTY_ROW_WORDS], int32_t size)
+{
+    BitRow pairsMask = row_first_bits(size - 1);
+    int32_t penalty = 0;
+    for (int32_t i = 0; i < size; i++) {
+        penalty += calc_rule1_line(row_load(lines[i]), pairsMask);
+    }
+    return penalty;
+}
+
+internal int32_t
+calc_rule2_lines(uint64_t (*lines)[PENALTY_ROW_WORDS], int32_t size)
+{
+    BitRow pairsMask = row_first_bits(size - 1);
+    BitRow prevLine = row_load(lines[0]);
+    BitRow prevEqual = row_andnot(row_xor(prevLine, row_shr(prevLine, 1)), pairsMask);
+    int32_t blocksCount = 0;
+    for (int32_t i = 1; i < size; i++) {
+        BitRow line = row_load(lines[i]);
+        BitRow equal = row_andnot(row_xor(line, row_shr(line, 1)), pairsMask);
+        BitRow blocks = row_andnot(row_xor(prevLine, line), row_and(prevEqual, equal));
+        blocksCount += row_popcount(blocks);
+        prevLine = line;
+        prevEqual = equal;
+    }
+    return 3 * blocksCount;
+}
+
+internal int32_t
+calc_rule3_lines(uint64_t (*lines)[PENALTY_ROW_WORDS], int32_t size)
+{
+    BitRow lineMask = row_first_bits(size);
+    int32_t penalty = 0;
+    for (int32_t i = 0; i < size; i++) {
+        penalty += calc_rule3_line(row_load(lines[i]), lineMask);
+    }
+    return penalty;
+}
+
+#if PENALTY_AVX2
+
+#define AVX2 __attribute__((target("avx2,popcnt")))
+
+AVX2 internal __m256i
+avx2_load(uint64_t *words)
+{
+    return _mm256_loadu_si256((__m256i *)words);
+}
+
+AVX2 internal __m256i
+avx2_first_bits(int32_t bitsCount)
+{
+    BitRow r = row_first_bits(bitsCount);
+    return avx2_load(r.words);
+}
+
+// Moves module (column + k) into column, 0 < k < 64.
+AVX2 internal __m256i
+avx2_shr(__m256i a, int32_t k)
+{
+    __m256i next = _mm256_permute4x64_epi64(a, _MM_SHUFFLE(3, 3, 2, 1));
+    next = _mm256_blend_epi32(next, _mm256_setzero_si256(), 0xC0);
+    return _mm256_or_si256(_mm256_srl_epi64(a, _mm_cvtsi32_si128(k)), _mm256_sll_epi64(next, _mm_cvtsi32_si128(64 - k)));
+}
+
+// Moves module (column - k) into column, 0 < k < 64.
+AVX2 internal __m256i
+avx2_shl(__m256i a, int32_t k)
+{
+    __m256i prev = _mm256_permute4x64_epi64(a, _MM_SHUFFLE(2, 1, 0, 0));
+    prev = _mm256_blend_epi32(prev, _mm256_setzero_si256(), 0x03);
+    return _mm256_or_si256(_mm256_sll_epi64(a, _mm_cvtsi32_si128(k)), _mm256_srl_epi64(prev, _mm_cvtsi32_si128(64 - k)));
+}
+
+AVX2 internal int32_t
+avx2_popcount(__m256i a)
+{
+    return __builtin_popcountll((uint64_t)_mm256_extract_epi64(a, 0))
+        + __builtin_popcountll((uint64_t)_mm256_extract_epi64(a, 1))
+        + __builtin_popcountll((uint64_t)_mm256_extract_epi64(a, 2))
+        + __builtin_popcountll((uint64_t)_mm256_extract_epi64(a, 3));
+}
+
+AVX2 internal int32_t
+avx2_rule1_lines(uint64_t (*lines)[PENALTY_ROW_WORDS], int32_t size)
+{
+    __m256i pairsMask = avx2_first_bits(size - 1);
+    int32_t penalty = 0;
+    for (int32_t i = 0; i < size; i++) {
+        __m256i line = avx2_load(lines[i]);
+        __m256i equal = _mm256_andnot_si256(_mm256_xor_si256(line, avx2_shr(line, 1)), pairsMask);
+        __m256i windows = _mm256_and_si256(_mm256_and_si256(equal, avx2_shr(equal, 1)),
+                                           _mm256_and_si256(avx2_shr(equal, 2), avx2_shr(equal, 3)));
+        __m256i runs = _mm256_andnot_si256(avx2_shl(windows, 1), windows);
+        penalty += avx2_popcount(windows) + 2 * avx2_popcount(runs);
+    }
+    return penalty;
+}
+
+AVX2 internal int32_t
+avx2_rule2_lines(uint64_t (*lines)[PENALTY_ROW_WORDS], int32_t size)
+{
+    __m256i pairsMask = avx2_first_bits(size - 1);
+    __m256i prevLine = avx2_load(lines[0]);
+    __m256i prevEqual = _mm256_andnot_si256(_mm256_xor_si256(prevLine, avx2_shr(prevLine, 1)), pairsMask);
+    int32_t blocksCount = 0;
+    for (int32_t i = 1; i < size; i++) {
+        __m256i line = avx2_load(lines[i]);
+        __m256i equal = _mm256_andnot_si256(_mm256_xor_si256(line, avx2_shr(line, 1)), pairsMask);
+        __m256i blocks = _mm256_andnot_si256(_mm256_xor_si256(prevLine, line), _mm256_and_si256(prevEqual, equal));
+        blocksCount += avx2_popcount(blocks);
+        prevLine = line;
+        prevEqual = equal;
+    }
+    return 3 * blocksCount;
+}
+
+AVX2 internal int32_t
+avx2_rule3_lines(uint64_t (*lines)[PENALTY_ROW_WORDS], int32_t size)
+{
+    __m256i lineMask = avx2_first_bits(size);
+    int32_t penalty = 0;
+    for (int32_t i = 0; i < size; i++) {
+        __m256i line = avx2_load(lines[i]);
+        __m256i light = _mm256_andnot_si256(line, lineMask);
+        __m256i pattern = _mm256_and_si256(
+            _mm256_and_si256(_mm256_and_si256(line, avx2_shr(light, 1)), _mm256_and_si256(avx2_shr(line, 2), avx2_shr(line, 3))),
+            _mm256_and_si256(_mm256_and_si256(avx2_shr(line, 4), avx2_shr(light, 5)), avx2_shr(line, 6)));
+        __m256i lightBefore = _mm256_and_si256(_mm256_and_si256(avx2_shl(light, 1), avx2_shl(light, 2)),
+                                               _mm256_and_si256(avx2_shl(light, 3), avx2_shl(light, 4)));
+        __m256i lightAfter = _mm256_and_si256(_mm256_and_si256(avx2_shr(light, 7), avx2_shr(light, 8)),
+                                              _mm256_and_si256(avx2_shr(light, 9), avx2_shr(light, 10)));
+        penalty += 40 * (avx2_popcount(_mm256_and_si256(pattern, lightBefore))
+                         + avx2_popcount(_mm256_and_si256(pattern, lightAfter)));
+    }
+    return penalty;
+}
+
+#undef AVX2
+
+#endif
+
+internal bool
+has_avx2(void)
+{
+#if PENALTY_AVX2
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+#else
+    return false;
+#endif
+}
+
+// Transposes a 64x64 bit block in place, bit j of block[i] swaps with bit i of block[j].
+internal void
+transpose_block(uint64_t *block)
+{
+    uint64_t mask = 0x00000000FFFFFFFFULL;
+    for (int32_t j = 32; j != 0; j >>= 1, mask ^= (mask << j)) {
+        for (int32_t k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+            uint64_t t = ((block[k] >> j) ^ block[k | j]) & mask;
+            block[k] ^= t << j;
+            block[k | j] ^= t;
+        }
+    }
+}
+
+internal void
+transpose_board(PenaltyBoard *board)
+{
+    int32_t blocksCount = (board->size + 63) / 64;
+    for (int32_t blockRow = 0; blockRow < blocksCount; blockRow++) {
+        for (int32_t blockColumn = 0; blockColumn < blocksCount; blockColumn++) {
+            uint64_t block[64];
+            for (int32_t i = 0; i < 64; i++) {
+                int32_t row = blockRow * 64 + i;
+                block[i] = (row < board->size) ? board->rows[row][blockColumn] : 0;
+            }
+            transpose_block(block);
+            for (int32_t i = 0; i < 64; i++) {
+                int32_t column = blockColumn * 64 + i;
+                if (column < board->size) {
+                    board->columns[column][blockRow] = block[i];
+                }
+            }
+        }
+    }
+    for (int32_t column = 0; column < board->size; column++) {
+        for (int32_t i = blocksCount; i < PENALTY_ROW_WORDS; i++) {
+            board->columns[column][i] = 0;
+        }
+    }
+    board->hasColumns = true;
+}
+
+void
+penalty_board_load(PenaltyBoard *board, QR *qr)
+{
+    ASSERT(qr->rowWords < PENALTY_ROW_WORDS);
+
+    board->size = qr->size;
+    board->hasColumns = false;
+    for (int32_t row = 0; row < qr->size; row++) {
+        for (int32_t i = 0; i < PENALTY_ROW_WORDS; i++) {
+            board->rows[row][i] = (i < qr->rowWords) ? qr->colors[row * qr->rowWords + i] : 0;
+        }
+    }
+}
+
+int32_t
+penalty_rule1(PenaltyBoard *board)
+{
+    if (!board->hasColumns) {
+        transpose_board(board);
+    }
+#if PENALTY_AVX2
+    if (has_avx2()) {
+        return avx2_rule1_lines(board->rows, board->size) + avx2_rule1_lines(board->columns, board->size);
+    }
+#endif
+    return calc_rule1_lines(board->rows, board->size) + calc_rule1_lines(board->columns, board->size);
+}
+
+int32_t
+penalty_rule2(PenaltyBoard *board)
+{
+#if PENALTY_AVX2
+    if (has_avx2()) {
+        return avx2_rule2_lines(board->rows, board->size);
+    }
+#endif
+    return calc_rule2_lines(board->rows, board->size);
+}
+
+int32_t
+penalty_rule3(PenaltyBoard *board)
+{
+    if (!board->hasColumns) {
+        transpose_board(board);
+    }
+#if PENALTY_AVX2
+    if (has_avx2()) {
+        return avx2_rule3_lines(board->rows, board->size) + avx2_rule3_lines(board->columns, board->size);
+    }
+#endif
+    return calc_rule3_lines(board->rows, board->size) + calc_rule3_lines(board->columns, board->size);
+}
+
+int32_t
+penalty_rule4(PenaltyBoard *board)
+{
+    int32_t totalModuleCount = board->size * board->size;
+    int32_t darkModuleCount = 0;
+    for (int32_t row = 0; row < board->size; row++) {
+        darkModuleCount += row_popcount(row_load(board->rows[row]));
+    }
+    int32_t fivePercentVariances = abs(darkModuleCount * 2 - totalModuleCount) * 10 / totalModuleCount;
+    int32_t penalty = fivePercentVariances * 10;
+    return penalty;
+}
@@ -0,0 +1,27 @@
+#ifndef PENALTY_H
+#define PENALTY_H
+
+#include <stdint.h>
+
+#include "qr.h"
+
+#define PENALTY_ROW_WORDS 4 // = 256 bits, leaves at least one zero word past MAX_SIZE
+
+// Module colors of a masked QR, laid out for word-parallel penalty scoring.
+// Every row (and every column, once transposed) is padded to 256 bits with zeros.
+typedef struct PenaltyBoard PenaltyBoard;
+struct PenaltyBoard
+{
+    uint64_t rows[MAX_SIZE][PENALTY_ROW_WORDS];
+    uint64_t columns[MAX_SIZE][PENALTY_ROW_WORDS];
+    int32_t size;
+    bool hasColumns;
+};
+
+void penalty_board_load(PenaltyBoard *board, QR *qr);
+int32_t penalty_rule1(PenaltyBoard *board);
+int32_t penalty_rule2(PenaltyBoard *board);
+int32_t penalty_rule3(PenaltyBoard *board);
+int32_t penalty_rule4(PenaltyBoard *board);
+
+#endif //PENALTY_H
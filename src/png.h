@@ -0,0 +1,31 @@
+#ifndef PNG_H
+#define PNG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PNG_MAX_ROW_LEN 1024 // filter byte + packed pixels of the widest 1-bit image
+#define PNG_MAX_DEFLATE_ROW_LEN (PNG_MAX_ROW_LEN * 9 / 8 + 16) // 9-bit literals, block header, zlib header and trailer
+
+// Compresses the rows of an image into a zlib stream, either as fixed Huffman codes of literals, runs and
+// copies of the row above, or as stored blocks.
+typedef struct PngDeflater PngDeflater;
+struct PngDeflater
+{
+    bool isStored;
+    int32_t rowLen;
+    int32_t rowsCount;
+    uint64_t bits;
+    int32_t bitsCount;
+    uint32_t adler;
+    uint8_t previousRow[PNG_MAX_ROW_LEN];
+};
+
+uint32_t png_crc32(uint32_t crc, const uint8_t *bytes, size_t len);
+uint32_t png_adler32(uint32_t adler, const uint8_t *bytes, size_t len);
+void png_deflate_init(PngDeflater *deflater, bool isStored, int32_t rowLen);
+// Writes up to PNG_MAX_DEFLATE_ROW_LEN bytes of the stream into out and returns their count.
+// The last row also ends the stream.
+int32_t png_deflate_row(PngDeflater *deflater, const uint8_t *row, bool isLast, uint8_t *out);
+
+#endif //PNG_H
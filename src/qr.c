@@ -1,91 +1,266 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "utils.h"
 #include "bv.h"
+#include "classify.h"
 #include "gf256.h"
+#include "pack.h"
 #include "qr.h"
+#include "penalty.h"
+
+const char *const EncodingModeNames[EM_COUNT] = {
+    "NUMERIC",
+    "ALPHANUMERIC",
+    "BYTE",
+    //"KANJI",
+};
+
+const char *const ErrorCorrectionLevelNames[ECL_COUNT] = {
+    "LOW",
+    "MEDIUM",
+    "QUARTILE",
+    "HIGH",
+};
+
+const char *const OutputFormatNames[OF_COUNT] = {
+    "ANSI",
+    "ASCII",
+    "UTF8",
+    "UTF8Q",
+    "ANSI_RLE",
+    "ANSI_RGB",
+    "ANSI_HALF",
+    "PBM",
+    "PGM",
+    "PNG",
+    "PNG_STORED",
+    "SVG",
+    "SVG_CRISP",
+};
+
+global const char *const QR_STATUS_MESSAGES[QR_STATUS_COUNT] = {
+    "success",
+    "a required argument is NULL",
+    "the text is empty",
+    "the text exceeds the maximum length",
+    "an option is out of its range",
+    "the text does not fit into any version at the error correction level",
+    "the text does not fit into the version at the error correction level",
+    "the text has characters the encoding mode does not cover",
+};
 
 #define MAX_BLOCKS_COUNT 81
 #define MAX_BLOCKS_LENGTH 153
 
 #define ALIGNMENT_COORDINATES_COUNT 7
 
-#define QR_FRAME_WIDTH 4
+#define MASK_PATTERN_ROWS 12
+
+#define PARALLEL_MASK_SEARCH_MIN_VERSION 19 // = version 20, smaller symbols don't pay for the threads
+
+#define MAX_SEGMENTS_COUNT 1313 // = max data bits / bits of the shortest segment (4 + 10 + 4)
+
+#define MAX_CONTENT_MODULES_COUNT 29648 // = CONTENT_MODULES_COUNT[MAX_VERSION]
 
-#define MAX_POLYNOM_DEGREE 123 // = max data codewords per block
 #define MAX_GENERATOR_POLYNOM_DEGREE 30 // = max error correction codewords per block
 
-#define QR_MODULE_VALUE(qr, row, column) ((qr)->matrix[(row) * (qr)->size + (column)])
-#define QR_MODULE_COLOR(qr, row, column) ((QR_MODULE_VALUE((qr), (row), (column))).color)
-#define QR_MODULE_TYPE(qr, row, column) ((QR_MODULE_VALUE((qr), (row), (column))).type)
-#define QR_IS_OUTSIDE(qr, row, column) (((row) < 0) || ((row) >= qr->size) || ((column) < 0) || ((column) >= qr->size))
+#define QR_ROW_WORDS(size) (((size) + 63) / 64)
+#define QR_MODULE_WORD(qr, row, column) ((row) * (qr)->rowWords + ((column) / 64))
+#define QR_MODULE_BIT(column) (1ULL << ((column) % 64))
+#define QR_ROW_WORD_MASK(qr, i) (((i) < (qr)->rowWords - 1) ? ~0ULL : (~0ULL >> (64 * (qr)->rowWords - (qr)->size)))
+#define QR_MODULE_COLOR(qr, row, column) ((ModuleColor)(((qr)->colors[QR_MODULE_WORD((qr), (row), (column))] >> ((column) % 64)) & 1))
+#define QR_MODULE_TYPE(qr, row, column) ((ModuleType)(((qr)->functional[QR_MODULE_WORD((qr), (row), (column))] >> ((column) % 64)) & 1))
 
-global const ModuleValue DATA_LIGHT = { .type = MT_DATA, .color = MC_LIGHT };
-global const ModuleValue DATA_DARK = { .type = MT_DATA, .color = MC_DARK };
-global const ModuleValue FUNCTIONAL_LIGHT = { .type = MT_FUNCTIONAL, .color = MC_LIGHT };
-global const ModuleValue FUNCTIONAL_DARK = { .type = MT_FUNCTIONAL, .color = MC_DARK };
+typedef int32_t ModuleType;
+enum ModuleType
+{
+    MT_DATA = 0,
+    MT_FUNCTIONAL = 1,
+};
 
-// Maximum length of the encoded text.
-global const int32_t MAX_CHAR_COUNT[EM_COUNT][ECL_COUNT][VERSION_COUNT] = {
-    // EM_NUMERIC
-    {
-        {  41,   77,  127,  187,  255,  322,  370,  461,  552,  652,
-          772,  883, 1022, 1101, 1250, 1408, 1548, 1725, 1903, 2061,
-         2232, 2409, 2620, 2812, 3057, 3283, 3517, 3669, 3909, 4158,
-         4417, 4686, 4965, 5253, 5529, 5836, 6153, 6479, 6743, 7089, },
-        {  34,   63,  101,  149,  202,  255,  293,  365,  432,  513,
-          604,  691,  796,  871,  991, 1082, 1212, 1346, 1500, 1600,
-         1708, 1872, 2059, 2188, 2395, 2544, 2701, 2857, 3035, 3289,
-         3486, 3693, 3909, 4134, 4343, 4588, 4775, 5039, 5313, 5596, },
-        {  27,   48,   77,  111,  144,  178,  207,  259,  312,  364,
-          427,  489,  580,  621,  703,  775,  876,  948, 1063, 1159,
-         1224, 1358, 1468, 1588, 1718, 1804, 1933, 2085, 2181, 2358,
-         2473, 2670, 2805, 2949, 3081, 3244, 3417, 3599, 3791, 3993, },
-        {  17,   34,   58,   82,  106,  139,  154,  202,  235,  288,
-          331,  374,  427,  468,  530,  602,  674,  746,  813,  919,
-          969, 1056, 1108, 1228, 1286, 1425, 1501, 1581, 1677, 1782,
-         1897, 2022, 2157, 2301, 2361, 2524, 2625, 2735, 2927, 3057, }
-    },
-    // EM_ALPHANUM
-    {
-        {  25,   47,   77,  114,  154,  195,  224,  279,  335,  395,
-          468,  535,  619,  667,  758,  854,  938, 1046, 1153, 1249,
-         1352, 1460, 1588, 1704, 1853, 1990, 2132, 2223, 2369, 2520,
-         2677, 2840, 3009, 3183, 3351, 3537, 3729, 3927, 4087, 4296, },
-        {  20,   38,   61,   90,  122,  154,  178,  221,  262,  311,
-          366,  419,  483,  528,  600,  656,  734,  816,  909,  970,
-         1035, 1134, 1248, 1326, 1451, 1542, 1637, 1732, 1839, 1994,
-         2113, 2238, 2369, 2506, 2632, 2780, 2894, 3054, 3220, 3391, },
-        {  16,   29,   47,   67,   87,  108,  125,  157,  189,  221,
-          259,  296,  352,  376,  426,  470,  531,  574,  644,  702,
-          742,  823,  890,  963, 1041, 1094, 1172, 1263, 1322, 1429,
-         1499, 1618, 1700, 1787, 1867, 1966, 2071, 2181, 2298, 2420, },
-        {  10,   20,   35,   50,   64,   84,   93,  122,  143,  174,
-          200,  227,  259,  283,  321,  365,  408,  452,  493,  557,
-          587,  640,  672,  744,  779,  864,  910,  958, 1016, 1080,
-         1150, 1226, 1307, 1394, 1431, 1530, 1591, 1658, 1774, 1852, }
-    },
-    // EM_BYTE
-    {
-        {  17,   32,   53,   78,  106,  134,  154,  192,  230,  271,
-          321,  367,  425,  458,  520,  586,  644,  718,  792,  858,
-          929, 1003, 1091, 1171, 1273, 1367, 1465, 1528, 1628, 1732,
-         1840, 1952, 2068, 2188, 2303, 2431, 2563, 2699, 2809, 2953, },
-        {  14,   26,   42,   62,   84,  106,  122,  152,  180,  213,
-          251,  287,  331,  362,  412,  450,  504,  560,  624,  666,
-          711,  779,  857,  911,  997, 1059, 1125, 1190, 1264, 1370,
-         1452, 1538, 1628, 1722, 1809, 1911, 1989, 2099, 2213, 2331, },
-        {  11,   20,   32,   46,   60,   74,   86,  108,  130,  151,
-          177,  203,  241,  258,  292,  322,  364,  394,  442,  482,
-          509,  565,  611,  661,  715,  751,  805,  868,  908,  982,
-         1030, 1112, 1168, 1228, 1283, 1351, 1423, 1499, 1579, 1663, },
-        {   7,   14,   24,   34,   44,   58,   64,   84,   98,  119,
-          137,  155,  177,  194,  220,  250,  280,  310,  338,  382,
-          403,  439,  461,  511,  535,  593,  625,  658,  698,  742,
-          790,  842,  898,  958,  983, 1051, 1093, 1139, 1219, 1273, }
-    },
+typedef struct ModuleValue ModuleValue;
+struct ModuleValue
+{
+    ModuleType type;
+    ModuleColor color;
+};
+
+typedef int32_t TemplateState;
+enum TemplateState
+{
+    TS_EMPTY,
+    TS_BUILDING,
+    TS_READY,
+};
+
+// Function patterns, reserved format & version modules and the placement order of data modules,
+// they only depend on the version.
+typedef struct VersionTemplate VersionTemplate;
+struct VersionTemplate
+{
+    uint64_t colors[MAX_MATRIX_WORDS];
+    uint64_t functional[MAX_MATRIX_WORDS];
+    uint16_t dataModules[MAX_CONTENT_MODULES_COUNT]; // bit index in the bitboards of the n-th data module
+    _Atomic TemplateState state;
+};
+
+// Error correction blocks, each one holds its data codewords followed by its error correction codewords.
+// Short blocks have an unused byte after their data codewords, so error correction codewords are aligned.
+typedef struct Codewords Codewords;
+struct Codewords
+{
+    uint8_t blocks[MAX_BLOCKS_COUNT][MAX_BLOCKS_LENGTH];
+    int32_t blocksCount;
+    int32_t shortBlocksCount;
+    int32_t shortBlockLength;
+    int32_t dataCodewordsCount;
+    int32_t errorCodewordsPerBlockCount;
+};
+
+// Run of characters encoded in one mode, with its own mode indicator and character count.
+typedef struct Segment Segment;
+struct Segment
+{
+    EncodingMode mode;
+    int32_t offset;
+    int32_t length;
+};
+
+typedef struct Segments Segments;
+struct Segments
+{
+    Segment items[MAX_SEGMENTS_COUNT];
+    int32_t count;
+    int32_t bitsCount; // including mode indicators and character counts
+};
+
+// Mode of the current segment and its character count modulo the group size of the mode.
+typedef int32_t SegmentState;
+enum SegmentState
+{
+    SS_NUMERIC_0,
+    SS_NUMERIC_1,
+    SS_NUMERIC_2,
+    SS_ALPHANUM_0,
+    SS_ALPHANUM_1,
+    SS_BYTE,
+
+    SS_COUNT,
+};
+
+global const EncodingMode SEGMENT_STATE_MODE[SS_COUNT] = {
+    EM_NUMERIC, EM_NUMERIC, EM_NUMERIC, EM_ALPHANUM, EM_ALPHANUM, EM_BYTE,
+};
+
+// State and added bits when the current segment takes one more character.
+// Numeric groups of 1, 2, 3 digits take 4, 7, 10 bits, alphanumeric groups of 1, 2 characters take 6, 11 bits.
+global const SegmentState SEGMENT_STATE_NEXT[SS_COUNT] = {
+    SS_NUMERIC_1, SS_NUMERIC_2, SS_NUMERIC_0, SS_ALPHANUM_1, SS_ALPHANUM_0, SS_BYTE,
+};
+global const int32_t SEGMENT_STATE_NEXT_BITS[SS_COUNT] = {
+    4, 3, 3, 6, 5, 8,
+};
+
+// State and bits of the first character of a new segment.
+global const SegmentState SEGMENT_FIRST_STATE[EM_COUNT] = {
+    SS_NUMERIC_1, SS_ALPHANUM_1, SS_BYTE,
 };
+global const int32_t SEGMENT_FIRST_BITS[EM_COUNT] = {
+    4, 6, 8,
+};
+
+// Scratch memory of split_segments.
+typedef struct SegmentSearch SegmentSearch;
+struct SegmentSearch
+{
+    uint8_t previousStates[MAX_TEXT_LEN][SS_COUNT]; // state before character i on the cheapest way to each state after it
+    uint8_t charModes[MAX_TEXT_LEN];
+};
+
+// Scratch memory of one qr_encode call, laid over the caller's QRWorkspace.
+// Every stage writes what it reads later, so nothing here is cleared between calls.
+typedef struct Workspace Workspace;
+struct Workspace
+{
+    CharRuns runs;
+    SegmentSearch search;
+    Segments segments;
+    BitVec bv;
+    Codewords codewords;
+};
+
+static_assert(sizeof(Workspace) <= sizeof(QRWorkspace), "QR_WORKSPACE_SIZE is too small");
+
+#define MAX_SERIAL_UNIT_CHARS 3
+#define MAX_SERIAL_CODEWORDS 32
+
+// Characters packed together, a numeric group, an alphanumeric pair or a byte, that hold counter digits.
+// Its packed value is fixedValue plus the digits times their weights.
+typedef struct SerialUnit SerialUnit;
+struct SerialUnit
+{
+    EncodingMode mode;
+    int32_t firstDigit; // of the counter
+    int32_t digitsCount;
+    uint32_t digitWeights[MAX_SERIAL_UNIT_CHARS];
+    uint32_t fixedValue;
+    int32_t width;
+    int32_t firstBit; // of the data bits
+};
+
+// Data codeword that counter bits can reach. Reed-Solomon codes are linear, so changing it by d changes the error
+// correction codewords of its block by d times the remainder of the codeword alone.
+typedef struct SerialCodeword SerialCodeword;
+struct SerialCodeword
+{
+    int32_t module;    // first entry of the codeword in the data modules order
+    int32_t blockSlot; // index into Serial.blocks
+    uint8_t errorNibbleProducts[2][16][MAX_GENERATOR_POLYNOM_DEGREE]; // as in GF256Generator
+};
+
+// Units keep their width whatever the counter, so every counter bit has a fixed place and a symbol is the base
+// with the counter bits placed on top.
+typedef struct Serial Serial;
+struct Serial
+{
+    QR base; // of the text with every counter bit cleared
+    int32_t counterWidth;
+    int64_t countersCount;
+    SerialUnit units[MAX_SERIAL_WIDTH];
+    int32_t unitsCount;
+    int32_t firstCodeword; // of the data codewords counter bits can reach
+    SerialCodeword codewords[MAX_SERIAL_CODEWORDS];
+    int32_t codewordsCount;
+    int32_t blocks[MAX_SERIAL_CODEWORDS]; // of the codewords, each once
+    int32_t blocksCount;
+    int32_t allBlocksCount;
+    int32_t dataCodewordsCount;
+    int32_t errorCodewordsPerBlockCount;
+};
+
+static_assert(sizeof(Serial) <= sizeof(QRSerial), "QR_SERIAL_SIZE is too small");
+
+// What qr_profile_encode needs that only depends on the mode, version, level and mask.
+typedef struct Profile Profile;
+struct Profile
+{
+    QR start; // the template with the format and version modules and the mask applied to its light data modules
+    GF256Generator generator;
+    EncodingMode mode;
+    int32_t maxTextLen;
+};
+
+static_assert(sizeof(Profile) <= sizeof(QRProfile), "QR_PROFILE_SIZE is too small");
+
+// Built lazily on first use of a version, then shared by all encodes.
+global VersionTemplate VERSION_TEMPLATES[VERSION_COUNT];
+
+global const ModuleValue FUNCTIONAL_LIGHT = { .type = MT_FUNCTIONAL, .color = MC_LIGHT };
+global const ModuleValue FUNCTIONAL_DARK = { .type = MT_FUNCTIONAL, .color = MC_DARK };
 
 // Number of bits allocated for the length of the encoded text.
 global const int32_t LENGTH_BITS_COUNT[EM_COUNT][VERSION_COUNT] = {
@@ -205,6 +380,122 @@ global const int32_t ALIGNMENT_COORDINATES[VERSION_COUNT][ALIGNMENT_COORDINATES_
     { 6, 30, 58, 86, 114, 142, 170 },
 };
 
+// Rows of the mask patterns, bit set == module inverted. The patterns repeat every 12 rows.
+global const uint64_t MASK_PATTERNS[MASK_COUNT][MASK_PATTERN_ROWS][MAX_ROW_WORDS] = {
+    {
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, },
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, },
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, },
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, },
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, },
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, },
+    },
+    {
+        { 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, },
+        { 0x0000000000000000ULL, 0x0000000000000000ULL, 0x0000000000000000ULL, },
+        { 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, },
+        { 0x0000000000000000ULL, 0x0000000000000000ULL, 0x0000000000000000ULL, },
+        { 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, },
+        { 0x0000000000000000ULL, 0x0000000000000000ULL, 0x0000000000000000ULL, },
+        { 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, },
+        { 0x0000000000000000ULL, 0x0000000000000000ULL, 0x0000000000000000ULL, },
+        { 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, },
+        { 0x0000000000000000ULL, 0x0000000000000000ULL, 0x0000000000000000ULL, },
+        { 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, },
+        { 0x0000000000000000ULL, 0x0000000000000000ULL, 0x0000000000000000ULL, },
+    },
+    {
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+    },
+    {
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x4924924924924924ULL, 0x2492492492492492ULL, 0x9249249249249249ULL, },
+        { 0x2492492492492492ULL, 0x9249249249249249ULL, 0x4924924924924924ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x4924924924924924ULL, 0x2492492492492492ULL, 0x9249249249249249ULL, },
+        { 0x2492492492492492ULL, 0x9249249249249249ULL, 0x4924924924924924ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x4924924924924924ULL, 0x2492492492492492ULL, 0x9249249249249249ULL, },
+        { 0x2492492492492492ULL, 0x9249249249249249ULL, 0x4924924924924924ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x4924924924924924ULL, 0x2492492492492492ULL, 0x9249249249249249ULL, },
+        { 0x2492492492492492ULL, 0x9249249249249249ULL, 0x4924924924924924ULL, },
+    },
+    {
+        { 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, 0x1C71C71C71C71C71ULL, },
+        { 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, 0x1C71C71C71C71C71ULL, },
+        { 0x8E38E38E38E38E38ULL, 0x38E38E38E38E38E3ULL, 0xE38E38E38E38E38EULL, },
+        { 0x8E38E38E38E38E38ULL, 0x38E38E38E38E38E3ULL, 0xE38E38E38E38E38EULL, },
+        { 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, 0x1C71C71C71C71C71ULL, },
+        { 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, 0x1C71C71C71C71C71ULL, },
+        { 0x8E38E38E38E38E38ULL, 0x38E38E38E38E38E3ULL, 0xE38E38E38E38E38EULL, },
+        { 0x8E38E38E38E38E38ULL, 0x38E38E38E38E38E3ULL, 0xE38E38E38E38E38EULL, },
+        { 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, 0x1C71C71C71C71C71ULL, },
+        { 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, 0x1C71C71C71C71C71ULL, },
+        { 0x8E38E38E38E38E38ULL, 0x38E38E38E38E38E3ULL, 0xE38E38E38E38E38EULL, },
+        { 0x8E38E38E38E38E38ULL, 0x38E38E38E38E38E3ULL, 0xE38E38E38E38E38EULL, },
+    },
+    {
+        { 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, },
+        { 0x1041041041041041ULL, 0x4104104104104104ULL, 0x0410410410410410ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x1041041041041041ULL, 0x4104104104104104ULL, 0x0410410410410410ULL, },
+        { 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, },
+        { 0x1041041041041041ULL, 0x4104104104104104ULL, 0x0410410410410410ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0x9249249249249249ULL, 0x4924924924924924ULL, 0x2492492492492492ULL, },
+        { 0x1041041041041041ULL, 0x4104104104104104ULL, 0x0410410410410410ULL, },
+    },
+    {
+        { 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, },
+        { 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, 0x1C71C71C71C71C71ULL, },
+        { 0xB6DB6DB6DB6DB6DBULL, 0xDB6DB6DB6DB6DB6DULL, 0x6DB6DB6DB6DB6DB6ULL, },
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0xDB6DB6DB6DB6DB6DULL, 0x6DB6DB6DB6DB6DB6ULL, 0xB6DB6DB6DB6DB6DBULL, },
+        { 0x1C71C71C71C71C71ULL, 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, },
+        { 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL, },
+        { 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, 0x1C71C71C71C71C71ULL, },
+        { 0xB6DB6DB6DB6DB6DBULL, 0xDB6DB6DB6DB6DB6DULL, 0x6DB6DB6DB6DB6DB6ULL, },
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0xDB6DB6DB6DB6DB6DULL, 0x6DB6DB6DB6DB6DB6ULL, 0xB6DB6DB6DB6DB6DBULL, },
+        { 0x1C71C71C71C71C71ULL, 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, },
+    },
+    {
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0x8E38E38E38E38E38ULL, 0x38E38E38E38E38E3ULL, 0xE38E38E38E38E38EULL, },
+        { 0x1C71C71C71C71C71ULL, 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, },
+        { 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, },
+        { 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, 0x1C71C71C71C71C71ULL, },
+        { 0xE38E38E38E38E38EULL, 0x8E38E38E38E38E38ULL, 0x38E38E38E38E38E3ULL, },
+        { 0x5555555555555555ULL, 0x5555555555555555ULL, 0x5555555555555555ULL, },
+        { 0x8E38E38E38E38E38ULL, 0x38E38E38E38E38E3ULL, 0xE38E38E38E38E38EULL, },
+        { 0x1C71C71C71C71C71ULL, 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, },
+        { 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, 0xAAAAAAAAAAAAAAAAULL, },
+        { 0x71C71C71C71C71C7ULL, 0xC71C71C71C71C71CULL, 0x1C71C71C71C71C71ULL, },
+        { 0xE38E38E38E38E38EULL, 0x8E38E38E38E38E38ULL, 0x38E38E38E38E38E3ULL, },
+    },
+};
+
 global const uint32_t FORMAT_BITS[ECL_COUNT][MASK_COUNT] = {
     // ECL_LOW
     { 0b111011111000100, 0b111001011110011, 0b111110110101010, 0b111100010011101,
@@ -307,48 +598,144 @@ calc_data_codewords_count(int32_t version, ErrorCorrectionLevel level)
     return dataCodewordsCount;
 }
 
+// Bits of a segment with its mode indicator and character count.
 internal int32_t
-find_first_unmatch_index(char *text, int32_t textLen, char *charsToMatch, int32_t offset)
+calc_segment_bits(EncodingMode mode, int32_t length, int32_t version)
 {
-    for (int32_t i = offset; i < textLen; i++) {
-        char ch = text[i];
-        if (!strchr(charsToMatch, ch)) {
-            return i;
-        }
+    int32_t bits = 4 + LENGTH_BITS_COUNT[mode][version];
+    if (mode == EM_NUMERIC) {
+        bits += (length / 3) * 10 + ((length % 3) ? (length % 3) * 3 + 1 : 0);
+    }
+    else if (mode == EM_ALPHANUM) {
+        bits += (length / 2) * 11 + (length % 2) * 6;
     }
-    return -1;
+    else {
+        bits += length * 8;
+    }
+    return bits;
 }
 
-internal EncodingMode
-get_encoding_mode(char *text, int32_t textLen)
+// Splits the text into segments with the fewest bits for the given version. Every character extends the
+// cheapest encodings found so far, either by continuing their segment or by starting a segment in another mode.
+internal void
+split_segments(CharRuns *runs, int32_t version, SegmentSearch *search, Segments *segments)
 {
-    int32_t i = find_first_unmatch_index(text, textLen, "0123456789", 0);
-    if (i < 0) {
-        return EM_NUMERIC;
+    int32_t textLen = runs->offsets[runs->count];
+    ASSERT(0 < textLen && textLen <= MAX_TEXT_LEN);
+
+    int32_t headerBits[EM_COUNT];
+    for (EncodingMode mode = 0; mode < EM_COUNT; mode++) {
+        headerBits[mode] = 4 + LENGTH_BITS_COUNT[mode][version];
     }
-    i = find_first_unmatch_index(text, textLen, "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:", i + 1);
-    if (i < 0) {
-        return EM_ALPHANUM;
+
+    if (runs->count == 1) {
+        // A single segment in the narrowest mode beats any split.
+        EncodingMode mode = runs->mode;
+        segments->items[0] = (Segment){ .mode = mode, .offset = 0, .length = textLen };
+        segments->count = 1;
+        segments->bitsCount = calc_segment_bits(mode, textLen, version);
+        return;
     }
-    return EM_BYTE;
-}
 
-internal int32_t
-get_version(EncodingMode mode, ErrorCorrectionLevel level, int32_t textCharCount)
-{
-    for (int32_t version = MIN_VERSION; version <= MAX_VERSION; version++) {
-        if (textCharCount <= MAX_CHAR_COUNT[mode][level][version]) {
-            return version;
+    uint8_t (*previousStates)[SS_COUNT] = search->previousStates;
+    int32_t bits[SS_COUNT];
+    for (SegmentState state = 0; state < SS_COUNT; state++) {
+        bits[state] = INT32_MAX;
+    }
+
+    for (int32_t run = 0, i = 0; i < textLen; i++) {
+        if (i == runs->offsets[run + 1]) {
+            run++;
+        }
+        EncodingMode charMode = runs->modes[run];
+        int32_t nextBits[SS_COUNT];
+        for (SegmentState state = 0; state < SS_COUNT; state++) {
+            nextBits[state] = INT32_MAX;
+        }
+
+        // Continue the current segment
+        for (SegmentState state = 0; state < SS_COUNT; state++) {
+            if (bits[state] == INT32_MAX || SEGMENT_STATE_MODE[state] < charMode) {
+                continue;
+            }
+            SegmentState nextState = SEGMENT_STATE_NEXT[state];
+            int32_t newBits = bits[state] + SEGMENT_STATE_NEXT_BITS[state];
+            if (newBits < nextBits[nextState]) {
+                nextBits[nextState] = newBits;
+                previousStates[i][nextState] = (uint8_t)state;
+            }
+        }
+
+        // Start a new segment in another mode
+        for (EncodingMode mode = charMode; mode < EM_COUNT; mode++) {
+            int32_t prevBits = (i == 0) ? 0 : INT32_MAX;
+            SegmentState prevState = SS_COUNT;
+            for (SegmentState state = 0; (i > 0) && (state < SS_COUNT); state++) {
+                if (SEGMENT_STATE_MODE[state] != mode && bits[state] < prevBits) {
+                    prevBits = bits[state];
+                    prevState = state;
+                }
+            }
+            if (prevBits == INT32_MAX) {
+                continue;
+            }
+            SegmentState nextState = SEGMENT_FIRST_STATE[mode];
+            int32_t newBits = prevBits + headerBits[mode] + SEGMENT_FIRST_BITS[mode];
+            if (newBits < nextBits[nextState]) {
+                nextBits[nextState] = newBits;
+                previousStates[i][nextState] = (uint8_t)prevState;
+            }
+        }
+
+        memcpy(bits, nextBits, sizeof(bits));
+    }
+
+    SegmentState state = 0;
+    for (SegmentState lastState = 1; lastState < SS_COUNT; lastState++) {
+        if (bits[lastState] < bits[state]) {
+            state = lastState;
         }
     }
-    return VERSION_INVALID;
+    segments->bitsCount = bits[state];
+
+    // Walk back to the start, then merge characters of the same mode into segments.
+    uint8_t *charModes = search->charModes;
+    for (int32_t i = textLen - 1; i >= 0; i--) {
+        charModes[i] = (uint8_t)SEGMENT_STATE_MODE[state];
+        state = previousStates[i][state];
+    }
+    segments->count = 0;
+    for (int32_t i = 0; i < textLen; i++) {
+        if (i > 0 && charModes[i] == charModes[i - 1]) {
+            segments->items[segments->count - 1].length++;
+            continue;
+        }
+        if (segments->count == MAX_SEGMENTS_COUNT) {
+            // More segments than any version can hold.
+            segments->bitsCount = INT32_MAX;
+            return;
+        }
+        Segment *segment = &segments->items[segments->count++];
+        segment->mode = charModes[i];
+        segment->offset = i;
+        segment->length = 1;
+    }
+}
+
+internal void
+set_module(QR *qr, int32_t row, int32_t column, ModuleValue value)
+{
+    int32_t word = QR_MODULE_WORD(qr, row, column);
+    uint64_t bit = QR_MODULE_BIT(column);
+    qr->colors[word] = (value.color == MC_DARK) ? (qr->colors[word] | bit) : (qr->colors[word] & ~bit);
+    qr->functional[word] = (value.type == MT_FUNCTIONAL) ? (qr->functional[word] | bit) : (qr->functional[word] & ~bit);
 }
 
 internal void
 draw_module(QR *qr, int32_t row, int32_t column, ModuleValue value)
 {
     if ((0 <= row && row < qr->size) && (0 <= column && column < qr->size)) {
-        QR_MODULE_VALUE(qr, row, column) = value;
+        set_module(qr, row, column, value);
     }
 }
 
@@ -406,10 +793,10 @@ draw_alignment_patterns(QR *qr)
             if (columnCenter == 0) {
                 break;
             }
-            if (QR_MODULE_TYPE(qr, rowCenter - 2, columnCenter - 2) == MT_NONE
-                && QR_MODULE_TYPE(qr, rowCenter - 2, columnCenter + 2) == MT_NONE
-                && QR_MODULE_TYPE(qr, rowCenter + 2, columnCenter - 2) == MT_NONE
-                && QR_MODULE_TYPE(qr, rowCenter + 2, columnCenter + 2) == MT_NONE) {
+            if (QR_MODULE_TYPE(qr, rowCenter - 2, columnCenter - 2) != MT_FUNCTIONAL
+                && QR_MODULE_TYPE(qr, rowCenter - 2, columnCenter + 2) != MT_FUNCTIONAL
+                && QR_MODULE_TYPE(qr, rowCenter + 2, columnCenter - 2) != MT_FUNCTIONAL
+                && QR_MODULE_TYPE(qr, rowCenter + 2, columnCenter + 2) != MT_FUNCTIONAL) {
                 int32_t row = rowCenter - 2;
                 int32_t column = columnCenter - 2;
                 draw_alignment_pattern(qr, row, column);
@@ -466,223 +853,147 @@ reserve_version_modules(QR *qr)
 }
 
 internal void
-draw_data(QR *qr, uint8_t *codewords, int32_t codewordsCount)
+build_data_modules_order(VersionTemplate *template, QR *qr)
 {
     int32_t column = qr->size - 1;
     int32_t row = qr->size - 1;
     int32_t rowDirection = -1; // -1 == up, +1 == down
-    int32_t codewordsIndex = 0;
-    int32_t bitIndex = 7;
+    int32_t dataModulesCount = 0;
 
     while (row >= 0 && column >= 0) {
-        if (QR_MODULE_TYPE(qr, row, column) == MT_NONE) {
-            if (codewordsIndex < codewordsCount) {
-                uint8_t codeword = codewords[codewordsIndex];
-                QR_MODULE_VALUE(qr, row, column) = ((codeword >> bitIndex) & 1) ? DATA_DARK : DATA_LIGHT;
-                if (bitIndex == 0) {
-                    codewordsIndex++;
-                    bitIndex = 7;
-                }
-                else {
-                    bitIndex--;
-                }
-            }
-            else {
-                QR_MODULE_VALUE(qr, row, column) = DATA_LIGHT;
-            }
-        } else {
-            if ((column == 6) || (column > 6 && column % 2 == 0) || (column < 6 && column % 2 == 1)) {
-                column -= 1;
-            }
-            else {
-                column += 1;
+        if (QR_MODULE_TYPE(qr, row, column) == MT_DATA) {
+            template->dataModules[dataModulesCount++] = (uint16_t)(row * qr->rowWords * 64 + column);
+        }
+        if ((column == 6) || (column > 6 && column % 2 == 0) || (column < 6 && column % 2 == 1)) {
+            column -= 1;
+        }
+        else {
+            column += 1;
+            row += rowDirection;
+            if (row < 0 || row == qr->size) {
+                rowDirection = -rowDirection;
+                column -= 2;
                 row += rowDirection;
-                if (row < 0 || row == qr->size) {
-                    rowDirection = -rowDirection;
-                    column -= 2;
-                    row += rowDirection;
-                }
             }
         }
     }
+    ASSERT(dataModulesCount == CONTENT_MODULES_COUNT[qr->version]);
 }
 
 internal void
-apply_mask(QR *qr, int32_t mask)
+build_version_template(VersionTemplate *template, int32_t version)
 {
-    for (int32_t row = 0; row < qr->size; row++) {
-        for (int32_t column = 0; column < qr->size; column++) {
-            if (QR_MODULE_TYPE(qr, row, column) != MT_DATA) {
-                continue;
-            }
+    QR qr = {};
+    qr.version = version;
+    qr.size = 4 * version + 21;
+    qr.rowWords = QR_ROW_WORDS(qr.size);
 
-            bool invert = false;
-            switch (mask) {
-                case 0: invert = ((row + column) % 2) == 0; break;
-                case 1: invert = (row % 2) == 0; break;
-                case 2: invert = (column % 3) == 0; break;
-                case 3: invert = ((row + column) % 3) == 0; break;
-                case 4: invert = (((row / 2) + (column / 3)) % 2) == 0; break;
-                case 5: invert = ((row * column) % 2) + ((row * column) % 3) == 0; break;
-                case 6: invert = ((((row * column) % 2) + ((row * column) % 3)) % 2) == 0; break;
-                case 7: invert = ((((row + column) % 2) + ((row * column) % 3)) % 2) == 0; break;
-                default: UNREACHABLE();
-            }
-            if (invert) {
-                QR_MODULE_COLOR(qr, row, column) ^= MC_DARK;
-            }
-        }
-    }
+    draw_functional_patterns(&qr);
+    reserve_format_modules(&qr);
+    reserve_version_modules(&qr);
+
+    int32_t wordsCount = qr.size * qr.rowWords;
+    memcpy(template->colors, qr.colors, wordsCount * sizeof(qr.colors[0]));
+    memcpy(template->functional, qr.functional, wordsCount * sizeof(qr.functional[0]));
+
+    build_data_modules_order(template, &qr);
 }
 
-internal int32_t
-calc_rule1_penalty(QR *qr)
+internal VersionTemplate *
+get_version_template(int32_t version)
 {
-    int32_t penalty = 0;
-    for (int32_t row = 0; row < qr->size; row++) {
-        int32_t count = 1;
-        ModuleColor prevColor = QR_MODULE_COLOR(qr, row, 0);
-        for (int32_t column = 1; column < qr->size; column++) {
-            ModuleColor color = QR_MODULE_COLOR(qr, row, column);
-            if (color == prevColor) {
-                count++;
-                if (count == 5) {
-                    penalty += 3;
-                } else if (count > 5) {
-                    penalty++;
-                }
-            } else {
-                prevColor = color;
-                count = 1;
-            }
-        }
+    ASSERT(MIN_VERSION <= version && version <= MAX_VERSION);
+
+    VersionTemplate *template = &VERSION_TEMPLATES[version];
+    if (atomic_load_explicit(&template->state, memory_order_acquire) == TS_READY) {
+        return template;
     }
-    for (int32_t column = 0; column < qr->size; column++) {
-        int32_t count = 1;
-        ModuleColor prevColor = QR_MODULE_COLOR(qr, 0, column);
-        for (int32_t row = 1; row < qr->size; row++) {
-            ModuleColor color = QR_MODULE_COLOR(qr, row, column);
-            if (color == prevColor) {
-                count++;
-                if (count == 5) {
-                    penalty += 3;
-                } else if (count > 5) {
-                    penalty++;
-                }
-            } else {
-                prevColor = color;
-                count = 1;
-            }
+    TemplateState expected = TS_EMPTY;
+    if (atomic_compare_exchange_strong(&template->state, &expected, TS_BUILDING)) {
+        build_version_template(template, version);
+        atomic_store_explicit(&template->state, TS_READY, memory_order_release);
+    }
+    else {
+        // Another thread is building the same template.
+        while (atomic_load_explicit(&template->state, memory_order_acquire) != TS_READY) {
+            sched_yield();
         }
     }
-    return penalty;
+    return template;
 }
 
-internal int32_t
-calc_rule2_penalty(QR *qr)
+internal void
+draw_template(QR *qr)
 {
-    int32_t penalty = 0;
-    for (int32_t row = 0; row < qr->size - 1; row++) {
-        for (int32_t column = 0; column < qr->size - 1; column++) {
-            ModuleColor color1 = QR_MODULE_COLOR(qr, row + 0, column + 0);
-            ModuleColor color2 = QR_MODULE_COLOR(qr, row + 0, column + 1);
-            ModuleColor color3 = QR_MODULE_COLOR(qr, row + 1, column + 0);
-            ModuleColor color4 = QR_MODULE_COLOR(qr, row + 1, column + 1);
-            if ((color1 == color2) && (color2 == color3) && (color3 == color4)) {
-                penalty += 3;
-            }
-        }
+    VersionTemplate *template = get_version_template(qr->version);
+    int32_t wordsCount = qr->size * qr->rowWords;
+    memcpy(qr->colors, template->colors, wordsCount * sizeof(qr->colors[0]));
+    memcpy(qr->functional, template->functional, wordsCount * sizeof(qr->functional[0]));
+}
+
+// Toggles the modules of the dark bits, so codewords can also be drawn onto a masked matrix,
+// or change the codeword a masked matrix already holds.
+internal void
+draw_codeword(QR *qr, const uint16_t *modules, uint8_t codeword)
+{
+    for (int32_t i = 0; i < 8; i++) {
+        uint16_t module = modules[i];
+        qr->colors[module / 64] ^= (uint64_t)((codeword >> (7 - i)) & 1) << (module % 64);
     }
-    return penalty;
 }
 
-internal int32_t
-calc_rule3_penalty(QR *qr)
+// Scatters the codewords of every block straight to their modules, interleaving them on the way.
+// The template leaves data modules light, so only dark modules are drawn, remainder modules stay light.
+internal void
+draw_data(QR *qr, Codewords *codewords)
 {
-    int32_t penalty = 0;
-    for (int32_t row = 0; row < qr->size; row++) {
-        for (int32_t column = 0; column < qr->size - 6; column++) {
-            if ((QR_MODULE_COLOR(qr, row, column + 0) == MC_DARK)
-                && (QR_MODULE_COLOR(qr, row, column + 1) == MC_LIGHT)
-                && (QR_MODULE_COLOR(qr, row, column + 2) == MC_DARK)
-                && (QR_MODULE_COLOR(qr, row, column + 3) == MC_DARK)
-                && (QR_MODULE_COLOR(qr, row, column + 4) == MC_DARK)
-                && (QR_MODULE_COLOR(qr, row, column + 5) == MC_LIGHT)
-                && (QR_MODULE_COLOR(qr, row, column + 6) == MC_DARK)) {
-                int32_t preLightModuleCount = 0;
-                int32_t postLightModuleCount = 0;
-                for (int32_t i = 1; i <= 4; i++) {
-                    if (((column - i) >= 0) && (QR_MODULE_COLOR(qr, row, column - i) == MC_LIGHT)) {
-                        preLightModuleCount++;
-                    }
-                    if (((column + 6 + i) < qr->size) && (QR_MODULE_COLOR(qr, row, column + 6 + i) == MC_LIGHT)) {
-                        postLightModuleCount++;
-                    }
-                }
-                if (preLightModuleCount == 4) {
-                    penalty += 40;
-                }
-                if (postLightModuleCount == 4) {
-                    penalty += 40;
-                }
-            }
+    const uint16_t *dataModules = get_version_template(qr->version)->dataModules;
+    int32_t blocksCount = codewords->blocksCount;
+    int32_t shortBlocksCount = codewords->shortBlocksCount;
+    int32_t shortDataLength = codewords->shortBlockLength - codewords->errorCodewordsPerBlockCount;
+    int32_t errorCodewordsOffset = shortDataLength + 1;
+
+    for (int32_t i = 0; i < blocksCount; i++) {
+        uint8_t *block = codewords->blocks[i];
+        for (int32_t j = 0; j < shortDataLength; j++) {
+            int32_t index = j * blocksCount + i;
+            draw_codeword(qr, &dataModules[index * 8], block[j]);
         }
-    }
-    for (int32_t column = 0; column < qr->size; column++) {
-        for (int32_t row = 0; row < qr->size - 6; row++) {
-            if ((QR_MODULE_COLOR(qr, row + 0, column) == MC_DARK)
-                && (QR_MODULE_COLOR(qr, row + 1, column) == MC_LIGHT)
-                && (QR_MODULE_COLOR(qr, row + 2, column) == MC_DARK)
-                && (QR_MODULE_COLOR(qr, row + 3, column) == MC_DARK)
-                && (QR_MODULE_COLOR(qr, row + 4, column) == MC_DARK)
-                && (QR_MODULE_COLOR(qr, row + 5, column) == MC_LIGHT)
-                && (QR_MODULE_COLOR(qr, row + 6, column) == MC_DARK)) {
-                int32_t preLightModuleCount = 0;
-                int32_t postLightModuleCount = 0;
-                for (int32_t i = 1; i <= 4; i++) {
-                    if (((row - i) >= 0) && (QR_MODULE_COLOR(qr, row - i, column) == MC_LIGHT)) {
-                        preLightModuleCount++;
-                    }
-                    if (((row + 6 + i) < qr->size) && (QR_MODULE_COLOR(qr, row + 6 + i, column) == MC_LIGHT)) {
-                        postLightModuleCount++;
-                    }
-                }
-                if (preLightModuleCount == 4) {
-                    penalty += 40;
-                }
-                if (postLightModuleCount == 4) {
-                    penalty += 40;
-                }
-            }
+        if (i >= shortBlocksCount) {
+            int32_t index = shortDataLength * blocksCount + (i - shortBlocksCount);
+            draw_codeword(qr, &dataModules[index * 8], block[shortDataLength]);
+        }
+        for (int32_t j = 0; j < codewords->errorCodewordsPerBlockCount; j++) {
+            int32_t index = codewords->dataCodewordsCount + j * blocksCount + i;
+            draw_codeword(qr, &dataModules[index * 8], block[errorCodewordsOffset + j]);
         }
     }
-    return penalty;
 }
 
-internal int32_t
-calc_rule4_penalty(QR *qr)
+internal void
+apply_mask(QR *qr, int32_t mask)
 {
-    int32_t totalModuleCount = qr->size * qr->size;
-    int32_t darkModuleCount = 0;
+    ASSERT(MIN_MASK <= mask && mask <= MAX_MASK);
+
     for (int32_t row = 0; row < qr->size; row++) {
-        for (int32_t column = 0; column < qr->size; column++) {
-            if (QR_MODULE_COLOR(qr, row, column) == MC_DARK) {
-                darkModuleCount++;
-            }
+        const uint64_t *pattern = MASK_PATTERNS[mask][row % MASK_PATTERN_ROWS];
+        for (int32_t i = 0; i < qr->rowWords; i++) {
+            int32_t word = row * qr->rowWords + i;
+            uint64_t dataModules = ~qr->functional[word] & QR_ROW_WORD_MASK(qr, i);
+            qr->colors[word] ^= pattern[i] & dataModules;
         }
     }
-    int32_t fivePercentVariances = abs(darkModuleCount * 2 - totalModuleCount) * 10 / totalModuleCount;
-    int32_t penalty = fivePercentVariances * 10;
-    return penalty;
 }
 
 internal int32_t
 calc_mask_penalty(QR *qr)
 {
-    int32_t penalty1 = calc_rule1_penalty(qr);
-    int32_t penalty2 = calc_rule2_penalty(qr);
-    int32_t penalty3 = calc_rule3_penalty(qr);
-    int32_t penalty4 = calc_rule4_penalty(qr);
+    PenaltyBoard board;
+    penalty_board_load(&board, qr);
+    int32_t penalty1 = penalty_rule1(&board);
+    int32_t penalty2 = penalty_rule2(&board);
+    int32_t penalty3 = penalty_rule3(&board);
+    int32_t penalty4 = penalty_rule4(&board);
     return penalty1 + penalty2 + penalty3 + penalty4;
 }
 
@@ -737,49 +1048,203 @@ draw_version_modules(QR *qr)
     }
 }
 
-internal QR
-analyse_data(char *text, int32_t textLen, ErrorCorrectionLevel forcedLevel, int32_t forcedVersion, bool isDebug)
+// Copies only the words of the matrix the version uses.
+internal void
+copy_qr(QR *dst, const QR *src)
 {
-    QR qr = {};
+    int32_t wordsCount = src->size * src->rowWords;
+    memcpy(dst->colors, src->colors, wordsCount * sizeof(src->colors[0]));
+    memcpy(dst->functional, src->functional, wordsCount * sizeof(src->functional[0]));
+    dst->size = src->size;
+    dst->rowWords = src->rowWords;
+    dst->mode = src->mode;
+    dst->level = src->level;
+    dst->version = src->version;
+}
+
+typedef struct MaskCandidate MaskCandidate;
+struct MaskCandidate
+{
+    QR qr;
+    int32_t mask;
+    int32_t penalty;
+};
+
+internal int32_t
+find_best_mask_sequential(QR *qr, const QRRenderOptions *render, bool isDebug, int32_t *bestPenalty)
+{
+    int32_t minPenalty = INT32_MAX;
+    int32_t bestMask = 0;
+    for (int32_t mask = 0; mask < MASK_COUNT; mask++) {
+        draw_format_modules(qr, mask);
+        draw_version_modules(qr);
+        apply_mask(qr, mask);
+
+        int32_t penalty = calc_mask_penalty(qr);
+        if (penalty < minPenalty) {
+            minPenalty = penalty;
+            bestMask = mask;
+        }
+
+        if (isDebug) {
+            fprintf(stderr, ">>> PENALTY FOR MASK %d: %d\n", mask, penalty);
+            qr_print(stderr, qr, render);
+            fprintf(stderr, "\n");
+        }
+
+        // re-applying reverts the mask
+        apply_mask(qr, mask);
+    }
+    *bestPenalty = minPenalty;
+    return bestMask;
+}
+
+internal void *
+score_mask_candidate(void *arg)
+{
+    MaskCandidate *candidate = arg;
+    draw_format_modules(&candidate->qr, candidate->mask);
+    draw_version_modules(&candidate->qr);
+    apply_mask(&candidate->qr, candidate->mask);
+    candidate->penalty = calc_mask_penalty(&candidate->qr);
+    return NULL;
+}
+
+internal int32_t
+find_best_mask_parallel(QR *qr, const QRRenderOptions *render, bool isDebug, int32_t *bestPenalty)
+{
+    if (qr->version < PARALLEL_MASK_SEARCH_MIN_VERSION) {
+        return find_best_mask_sequential(qr, render, isDebug, bestPenalty);
+    }
+
+    // Every mask is scored on a private copy, so the threads share nothing.
+    MaskCandidate candidates[MASK_COUNT];
+    pthread_t threads[MASK_COUNT];
+    bool isThreadStarted[MASK_COUNT] = {};
+    for (int32_t mask = 0; mask < MASK_COUNT; mask++) {
+        MaskCandidate *candidate = &candidates[mask];
+        copy_qr(&candidate->qr, qr);
+        candidate->mask = mask;
+        isThreadStarted[mask] = pthread_create(&threads[mask], NULL, score_mask_candidate, candidate) == 0;
+        if (!isThreadStarted[mask]) {
+            score_mask_candidate(candidate);
+        }
+    }
+
+    int32_t minPenalty = INT32_MAX;
+    int32_t bestMask = 0;
+    for (int32_t mask = 0; mask < MASK_COUNT; mask++) {
+        MaskCandidate *candidate = &candidates[mask];
+        if (isThreadStarted[mask]) {
+            pthread_join(threads[mask], NULL);
+        }
+        if (candidate->penalty < minPenalty) {
+            minPenalty = candidate->penalty;
+            bestMask = mask;
+        }
+
+        if (isDebug) {
+            fprintf(stderr, ">>> PENALTY FOR MASK %d: %d\n", mask, candidate->penalty);
+            qr_print(stderr, &candidate->qr, render);
+            fprintf(stderr, "\n");
+        }
+    }
+    *bestPenalty = minPenalty;
+    return bestMask;
+}
+
+internal int32_t
+find_best_mask_bounded(QR *qr, const QRRenderOptions *render, bool isDebug, int32_t *bestPenalty)
+{
+    // All rules are non-negative, so a mask whose partial penalty already reaches the best one cannot win.
+    int32_t minPenalty = INT32_MAX;
+    int32_t bestMask = 0;
+    for (int32_t mask = 0; mask < MASK_COUNT; mask++) {
+        draw_format_modules(qr, mask);
+        draw_version_modules(qr);
+        apply_mask(qr, mask);
+
+        PenaltyBoard board;
+        penalty_board_load(&board, qr);
+        int32_t penalty = penalty_rule4(&board) + penalty_rule2(&board);
+        bool isPruned = penalty >= minPenalty;
+        if (!isPruned) {
+            penalty += penalty_rule1(&board);
+            isPruned = penalty >= minPenalty;
+        }
+        if (!isPruned) {
+            penalty += penalty_rule3(&board);
+            isPruned = penalty >= minPenalty;
+        }
+        if (!isPruned) {
+            minPenalty = penalty;
+            bestMask = mask;
+        }
+
+        if (isDebug) {
+            if (isPruned) {
+                fprintf(stderr, ">>> PENALTY FOR MASK %d: at least %d (pruned)\n", mask, penalty);
+            }
+            else {
+                fprintf(stderr, ">>> PENALTY FOR MASK %d: %d\n", mask, penalty);
+            }
+            qr_print(stderr, qr, render);
+            fprintf(stderr, "\n");
+        }
 
+        // re-applying reverts the mask
+        apply_mask(qr, mask);
+    }
+    *bestPenalty = minPenalty;
+    return bestMask;
+}
+
+internal QRStatus
+analyse_data(const char *text, int32_t textLen, ErrorCorrectionLevel forcedLevel, int32_t forcedVersion,
+             QR *qr, Workspace *workspace, bool isDebug)
+{
     // 1. Data analysis.
-    qr.mode = get_encoding_mode(text, textLen);
+    CharRuns *runs = &workspace->runs;
+    SegmentSearch *search = &workspace->search;
+    Segments *segments = &workspace->segments;
+    classify_text(text, textLen, runs);
+    qr->mode = runs->mode;
 
-    qr.level = (forcedLevel != LEVEL_INVALID) ? forcedLevel : ECL_LOW;
+    qr->level = (forcedLevel != LEVEL_INVALID) ? forcedLevel : ECL_LOW;
 
-    qr.version = (forcedVersion != VERSION_INVALID) ? forcedVersion : get_version(qr.mode, qr.level, textLen);
-    if (qr.version == VERSION_INVALID) {
-        fprintf(stderr,
-                "Failed to find a suitable version for a text of length %d "
-                "with %s mode "
-                "and %s error correction level\n",
-                textLen,
-                EncodingModeNames[qr.mode],
-                ErrorCorrectionLevelNames[qr.level]);
-        exit(1);
+    if (forcedVersion != VERSION_INVALID) {
+        qr->version = forcedVersion;
+        split_segments(runs, qr->version, search, segments);
+    }
+    else {
+        // The segmentation only changes when the character count lengths do.
+        qr->version = VERSION_INVALID;
+        for (int32_t version = 0; version < VERSION_COUNT; version++) {
+            if (version == 0 || LENGTH_BITS_COUNT[EM_NUMERIC][version] != LENGTH_BITS_COUNT[EM_NUMERIC][version - 1]) {
+                split_segments(runs, version, search, segments);
+            }
+            if (segments->bitsCount <= calc_data_codewords_count(version, qr->level) * 8) {
+                qr->version = version;
+                break;
+            }
+        }
+        if (qr->version == VERSION_INVALID) {
+            return QR_ERROR_NO_VERSION_FITS;
+        }
     }
 
     if (forcedLevel == LEVEL_INVALID) {
         // Try to increase the error correction level while still staying in the same version.
-        for (ErrorCorrectionLevel newLevel = qr.level + 1; newLevel <= ECL_HIGH; newLevel++) {
-            if (textLen > MAX_CHAR_COUNT[qr.mode][newLevel][qr.version]) {
+        for (ErrorCorrectionLevel newLevel = qr->level + 1; newLevel <= ECL_HIGH; newLevel++) {
+            if (segments->bitsCount > calc_data_codewords_count(qr->version, newLevel) * 8) {
                 break;
             }
-            qr.level = newLevel;
+            qr->level = newLevel;
         }
     }
 
-    if (textLen > MAX_CHAR_COUNT[qr.mode][qr.level][qr.version]) {
-        fprintf(stderr,
-                "The text exceeds the length limit of %d characters "
-                "for %s mode "
-                "and %s error correction level "
-                "and version %d\n",
-                MAX_CHAR_COUNT[qr.mode][qr.level][qr.version],
-                EncodingModeNames[qr.mode],
-                ErrorCorrectionLevelNames[qr.level],
-                qr.version);
-        exit(1);
+    if (segments->bitsCount > calc_data_codewords_count(qr->version, qr->level) * 8) {
+        return QR_ERROR_VERSION_TOO_SMALL;
     }
 
     if (isDebug) {
@@ -800,88 +1265,73 @@ analyse_data(char *text, int32_t textLen, ErrorCorrectionLevel forcedLevel, int3
         }
         fprintf(stderr, "\n");
         fprintf(stderr, "Text length: %d\n", textLen);
-        fprintf(stderr, "Encoding mode: %s\n", EncodingModeNames[qr.mode]);
-        fprintf(stderr, "QR version: %d\n", qr.version + 1);
-        fprintf(stderr, "Error correction level: %s\n", ErrorCorrectionLevelNames[qr.level]);
+        fprintf(stderr, "Encoding mode: %s\n", EncodingModeNames[qr->mode]);
+        if (segments->count > 1) {
+            fprintf(stderr, "Segments:");
+            for (int32_t i = 0; i < segments->count; i++) {
+                fprintf(stderr, " %s(%d)", EncodingModeNames[segments->items[i].mode], segments->items[i].length);
+            }
+            fprintf(stderr, "\n");
+        }
+        fprintf(stderr, "QR version: %d\n", qr->version + 1);
+        fprintf(stderr, "Error correction level: %s\n", ErrorCorrectionLevelNames[qr->level]);
         fprintf(stderr, "\n");
     }
-    return qr;
+    return QR_OK;
 }
 
-internal BitVec
-encode_data(QR* qr, char *text, int32_t textLen, bool isDebug)
+internal void
+encode_data(QR *qr, const char *text, Segments *segments, BitVec *bv, bool isDebug)
 {
     // 2. Data Encoding
-    BitVec bv = {};
+    bv_init(bv);
 
-    // Encoding mode
-    bv_append(&bv, (1U) << qr->mode, 4);
+    for (int32_t segmentIndex = 0; segmentIndex < segments->count; segmentIndex++) {
+        Segment *segment = &segments->items[segmentIndex];
+        const char *segmentText = text + segment->offset;
+        int32_t segmentLen = segment->length;
 
-    // Text length
-    int32_t lengthBitCount = LENGTH_BITS_COUNT[qr->mode][qr->version];
-    bv_append(&bv, textLen, lengthBitCount);
+        // Encoding mode
+        bv_append(bv, (1U) << segment->mode, 4);
 
-    // Text itself
-    if (qr->mode == EM_NUMERIC) {
-        int32_t number = 0;
-        for (int32_t i = 0; i < textLen; i++) {
-            uint8_t ch = text[i];
-            int32_t digit = ch - '0';
-            number = number * 10 + digit;
-            if (((i % 3) == 2) || (i == (textLen - 1))) {
-                bv_append(&bv, number, (number >= 100) ? 10 : ((number >= 10) ? 7 : 4));
-                number = 0;
-            }
+        // Text length
+        int32_t lengthBitCount = LENGTH_BITS_COUNT[segment->mode][qr->version];
+        bv_append(bv, segmentLen, lengthBitCount);
+
+        // Text itself
+        if (segment->mode == EM_NUMERIC) {
+            pack_numeric(bv, segmentText, segmentLen);
         }
-    }
-    else if (qr->mode == EM_ALPHANUM) {
-        int32_t number = 0;
-        for (int32_t i = 0; i < textLen; i++) {
-            uint8_t ch = text[i];
-
-            int32_t addend = 0;
-            if (ch >= '0' && ch <= '9') addend = ch - '0';
-            else if (ch >= 'A' && ch <= 'Z') addend = ch - 'A' + 10;
-            else if (ch == ' ') addend = 36;
-            else if (ch == '$') addend = 37;
-            else if (ch == '%') addend = 38;
-            else if (ch == '*') addend = 39;
-            else if (ch == '+') addend = 40;
-            else if (ch == '-') addend = 41;
-            else if (ch == '.') addend = 42;
-            else if (ch == '/') addend = 43;
-            else if (ch == ':') addend = 44;
-            else ASSERT(false); // unreachable
-
-            number = number * 45 + addend;
-            if (((i % 2) == 1) || (i == (textLen - 1))) {
-                bv_append(&bv, number, ((i % 2) == 1) ? 11 : 6);
-                number = 0;
-            }
+        else if (segment->mode == EM_ALPHANUM) {
+            pack_alphanum(bv, segmentText, segmentLen);
         }
-    }
-    else {
-        for (int32_t i = 0; i < textLen; i++) {
-            bv_append(&bv, text[i], 8);
+        else {
+            bv_append_bytes(bv, (const uint8_t *)segmentText, segmentLen);
         }
     }
+    // The packers write exactly the bits the segmentation was costed at.
+    ASSERT(bv->size == segments->bitsCount);
 
     int32_t dataCodewordsCount = calc_data_codewords_count(qr->version, qr->level);
     int32_t dataModulesCount = dataCodewordsCount * 8;
 
     // Terminator zeros
-    int32_t terminatorLength = MIN(dataModulesCount - bv.size, 4);
-    bv_append(&bv, 0, terminatorLength);
+    int32_t terminatorLength = MIN(dataModulesCount - bv->size, 4);
+    bv_append(bv, 0, terminatorLength);
 
     // Zero padding for 8 bit alignment
-    int32_t zeroPaddingLength = ((bv.size % 8) == 0) ? 0 : 8 - (bv.size % 8);
-    bv_append(&bv, 0, zeroPaddingLength);
+    int32_t zeroPaddingLength = ((bv->size % 8) == 0) ? 0 : 8 - (bv->size % 8);
+    bv_append(bv, 0, zeroPaddingLength);
 
     // Padding pattern
-    int32_t paddingLength = dataModulesCount - bv.size;
-    for (int32_t i = 0; i < (paddingLength / 8); i++) {
-        bv_append(&bv, (i & 1) ? 17 : 236, 8);
+    int32_t paddingBytesCount = (dataModulesCount - bv->size) / 8;
+    for (int32_t i = 0; i < (paddingBytesCount / 2); i++) {
+        bv_append(bv, (236 << 8) | 17, 16);
     }
+    if (paddingBytesCount % 2) {
+        bv_append(bv, 236, 8);
+    }
+    bv_flush(bv);
 
     if (isDebug) {
         fprintf(stderr, ">>> DATA ENCODING\n");
@@ -894,18 +1344,19 @@ encode_data(QR* qr, char *text, int32_t textLen, bool isDebug)
 
         fprintf(stderr, "\n");
     }
-
-    return bv;
 }
 
-internal int32_t
-prepare_codewords(QR *qr, BitVec *bv, uint8_t *codewords, bool isDebug)
+internal void
+init_generator(GF256Generator *generator, int32_t version, ErrorCorrectionLevel level)
 {
-    // 3. Error correction coding
-    uint8_t blocks[MAX_BLOCKS_COUNT][MAX_BLOCKS_LENGTH] = {};
+    int32_t errorCodewordsPerBlockCount = ERROR_CORRECTION_CODEWORDS_PER_BLOCK_COUNT[level][version];
+    gf256_generator_init(generator, GENERATOR_POLYNOM[errorCodewordsPerBlockCount], errorCodewordsPerBlockCount);
+}
 
-    // Divide data codewords into blocks and calculate error correction codewords for them
-    uint8_t *dataCodewords = bv->bytes;
+// Divides the data codewords into blocks and calculates the error correction codewords for them.
+internal void
+fill_codewords(QR *qr, const uint8_t *dataCodewords, const GF256Generator *generator, Codewords *codewords)
+{
     int32_t contentCodewordsCount = CONTENT_MODULES_COUNT[qr->version] / 8;
 
     int32_t blocksCount = ERROR_CORRECTION_BLOCKS_COUNT[qr->level][qr->version];
@@ -916,60 +1367,54 @@ prepare_codewords(QR *qr, BitVec *bv, uint8_t *codewords, bool isDebug)
     ASSERT(shortBlockLength <= MAX_BLOCKS_LENGTH);
 
     int32_t errorCodewordsPerBlockCount = ERROR_CORRECTION_CODEWORDS_PER_BLOCK_COUNT[qr->level][qr->version];
-    uint8_t *divisor = (uint8_t *)GENERATOR_POLYNOM[errorCodewordsPerBlockCount];
+    ASSERT(generator->degree == errorCodewordsPerBlockCount);
+
+    codewords->blocksCount = blocksCount;
+    codewords->shortBlocksCount = shortBlocksCount;
+    codewords->shortBlockLength = shortBlockLength;
+    codewords->dataCodewordsCount = calc_data_codewords_count(qr->version, qr->level);
+    codewords->errorCodewordsPerBlockCount = errorCodewordsPerBlockCount;
 
     int32_t dataCodewordsIndex = 0;
-    uint8_t errorCodewords[MAX_POLYNOM_DEGREE + MAX_GENERATOR_POLYNOM_DEGREE + 1] = {};
+    int32_t errorCodewordsOffset = shortBlockLength - errorCodewordsPerBlockCount + 1;
     for (int32_t i = 0; i < blocksCount; i++) {
-        uint8_t *block = blocks[i];
-        int32_t blockIndex = 0;
+        uint8_t *block = codewords->blocks[i];
 
         // Copy data codewords to block
         int32_t currBlockLength = (i < shortBlocksCount) ? shortBlockLength : shortBlockLength + 1;
         int32_t dataCodewordsPerBlockCount = currBlockLength - errorCodewordsPerBlockCount;
-        for (int32_t j = 0; j < dataCodewordsPerBlockCount; j++) {
-            block[blockIndex++] = dataCodewords[dataCodewordsIndex++];
-        }
+        memcpy(block, &dataCodewords[dataCodewordsIndex], dataCodewordsPerBlockCount);
+        dataCodewordsIndex += dataCodewordsPerBlockCount;
 
         // Pad shorter blocks for easier interleaving later
         if (i < shortBlocksCount) {
-            blockIndex++;
+            block[dataCodewordsPerBlockCount] = 0;
         }
 
-        // Calculate error correcting codewords
-        int32_t remainderLength = gf256_polynom_divide(block,
-                                                       currBlockLength,
-                                                       divisor,
-                                                       errorCodewordsPerBlockCount + 1,
-                                                       errorCodewords);
-        ASSERT(remainderLength == errorCodewordsPerBlockCount);
-
-        // Copy error correcting codewords to block
-        int32_t errorCodewordsIndex = 0;
-        for (int32_t j = 0; j < errorCodewordsPerBlockCount; j++) {
-            block[blockIndex++] = errorCodewords[errorCodewordsIndex++];
-        }
+        // Calculate error correcting codewords right after the (padded) data codewords
+        gf256_rs_remainder(generator, block, dataCodewordsPerBlockCount, &block[errorCodewordsOffset]);
     }
+}
 
-    // Interleave codewords
-    int32_t codewordsCount = 0;
-    for (int32_t i = 0; i < (shortBlockLength + 1); i++) {
-        for (int32_t j = 0; j < blocksCount; j++) {
-            if (j < shortBlocksCount && i == (shortBlockLength - errorCodewordsPerBlockCount)) {
-                // skip the padding on shorter blocks
-                continue;
-            }
-            codewords[codewordsCount++] = blocks[j][i];
-        }
-    }
+internal void
+prepare_codewords(QR *qr, BitVec *bv, Codewords *codewords, bool isDebug)
+{
+    // 3. Error correction coding
+    GF256Generator generator;
+    init_generator(&generator, qr->version, qr->level);
+    fill_codewords(qr, bv->bytes, &generator, codewords);
 
     if (isDebug) {
+        int32_t blocksCount = codewords->blocksCount;
+        int32_t shortBlocksCount = codewords->shortBlocksCount;
+        int32_t shortBlockLength = codewords->shortBlockLength;
+        int32_t errorCodewordsPerBlockCount = codewords->errorCodewordsPerBlockCount;
         fprintf(stderr, ">>> ERROR CORRECTION CODE GENERATION\n");
 
         fprintf(stderr, "Block count: %d\n", blocksCount);
         for (int32_t i = 0; i < blocksCount; i++) {
             fprintf(stderr, "Block #%d: ", i);
-            uint8_t *block = blocks[i];
+            uint8_t *block = codewords->blocks[i];
             int32_t currBlockLength = (i < shortBlocksCount) ? shortBlockLength : shortBlockLength + 1;
             for (int32_t j = 0; j < currBlockLength; j++) {
                 fprintf(stderr, "%02X ", block[j]);
@@ -978,78 +1423,58 @@ prepare_codewords(QR *qr, BitVec *bv, uint8_t *codewords, bool isDebug)
         }
 
         fprintf(stderr, "Interleaved codewords: ");
-        for (int32_t i = 0; i < codewordsCount; i++) {
-            fprintf(stderr, "%02X ", codewords[i]);
+        for (int32_t i = 0; i < (shortBlockLength + 1); i++) {
+            for (int32_t j = 0; j < blocksCount; j++) {
+                if (j < shortBlocksCount && i == (shortBlockLength - errorCodewordsPerBlockCount)) {
+                    // skip the padding on shorter blocks
+                    continue;
+                }
+                fprintf(stderr, "%02X ", codewords->blocks[j][i]);
+            }
         }
         fprintf(stderr, "\n");
 
         fprintf(stderr, "\n");
     }
-
-    return codewordsCount;
 }
 
 internal void
 draw_matrix(QR *qr,
-            uint8_t *codewords,
-            int32_t codewordsCount,
+            Codewords *codewords,
             int32_t forcedMask,
-            OutputFormat outputFormat,
+            MaskSearch maskSearch,
+            const QRRenderOptions *render,
             bool isDebug)
 {
-    // Draw functional QR patterns
+    // Draw functional QR patterns and reserve format & version modules
     qr->size = 4 * qr->version + 21;
-
-    draw_functional_patterns(qr);
-
-    if (isDebug) {
-        fprintf(stderr, ">>> PLACING FUNCTIONAL PATTERNS\n");
-        qr_print(stderr, qr, outputFormat);
-        fprintf(stderr, "\n");
-    }
-
-    // Reserve format & version modules
-    reserve_format_modules(qr);
-    reserve_version_modules(qr);
+    qr->rowWords = QR_ROW_WORDS(qr->size);
+    draw_template(qr);
 
     if (isDebug) {
-        fprintf(stderr, ">>> RESERVING FORMAT & VERSION MODULES\n");
-        qr_print(stderr, qr, outputFormat);
+        fprintf(stderr, ">>> PLACING FUNCTIONAL PATTERNS & RESERVING FORMAT & VERSION MODULES\n");
+        qr_print(stderr, qr, render);
         fprintf(stderr, "\n");
     }
 
     // Draw QR data
-    draw_data(qr, codewords, codewordsCount);
+    draw_data(qr, codewords);
 
     if (isDebug) {
         fprintf(stderr, ">>> PLACING DATA MODULES\n");
-        qr_print(stderr, qr, outputFormat);
+        qr_print(stderr, qr, render);
         fprintf(stderr, "\n");
     }
 
     // Apply data masking
-    int32_t minPenalty = INT32_MAX;
     int32_t bestMask = 0;
+    int32_t bestPenalty = -1;
     if (forcedMask == MASK_INVALID) {
-        for (int32_t mask = 0; mask < MASK_COUNT; mask++) {
-            draw_format_modules(qr, mask);
-            draw_version_modules(qr);
-            apply_mask(qr, mask);
-
-            int32_t penalty = calc_mask_penalty(qr);
-            if (penalty < minPenalty) {
-                minPenalty = penalty;
-                bestMask = mask;
-            }
-
-            if (isDebug) {
-                fprintf(stderr, ">>> PENALTY FOR MASK %d: %d\n", mask, penalty);
-                qr_print(stderr, qr, outputFormat);
-                fprintf(stderr, "\n");
-            }
-
-            // re-applying reverts the mask
-            apply_mask(qr, mask);
+        switch (maskSearch) {
+            case MS_SEQUENTIAL: bestMask = find_best_mask_sequential(qr, render, isDebug, &bestPenalty); break;
+            case MS_PARALLEL: bestMask = find_best_mask_parallel(qr, render, isDebug, &bestPenalty); break;
+            case MS_BOUNDED: bestMask = find_best_mask_bounded(qr, render, isDebug, &bestPenalty); break;
+            default: UNREACHABLE();
         }
     }
     else {
@@ -1059,7 +1484,7 @@ draw_matrix(QR *qr,
 
     if (isDebug) {
         fprintf(stderr, ">>> APPLYING DATA MASK %d\n", bestMask);
-        qr_print(stderr, qr, outputFormat);
+        qr_print(stderr, qr, render);
         fprintf(stderr, "\n");
     }
 
@@ -1067,159 +1492,395 @@ draw_matrix(QR *qr,
     draw_format_modules(qr, bestMask);
     draw_version_modules(qr);
 
+    qr->mask = bestMask;
+    qr->penalty = (bestPenalty >= 0) ? bestPenalty : calc_mask_penalty(qr);
+
     if (isDebug) {
         fprintf(stderr, ">>> PLACING FORMAT & VERSION MODULES\n");
-        qr_print(stderr, qr, outputFormat);
+        qr_print(stderr, qr, render);
         fprintf(stderr, "\n");
     }
 }
 
-QR
-qr_encode(QROptions *options)
+QRStatus
+qr_encode(const char *text, int32_t textLen, const QROptions *options, QRWorkspace *workspace, QR *qr)
 {
-    char *text = options->text;
-    int32_t textLen = options->textLen;
+    if (options == NULL || workspace == NULL || qr == NULL) {
+        return QR_ERROR_NULL_ARGUMENT;
+    }
+    if (text == NULL || textLen <= 0) {
+        return QR_ERROR_EMPTY_TEXT;
+    }
+    if (textLen > MAX_TEXT_LEN) {
+        return QR_ERROR_TEXT_TOO_LONG;
+    }
+    bool isLevelValid = options->forcedLevel == LEVEL_INVALID
+        || (ECL_LOW <= options->forcedLevel && options->forcedLevel <= ECL_HIGH);
+    bool isVersionValid = options->forcedVersion == VERSION_INVALID
+        || (MIN_VERSION <= options->forcedVersion && options->forcedVersion <= MAX_VERSION);
+    bool isMaskValid = options->forcedMask == MASK_INVALID
+        || (MIN_MASK <= options->forcedMask && options->forcedMask <= MAX_MASK);
+    bool isMaskSearchValid = MS_SEQUENTIAL <= options->maskSearch && options->maskSearch <= MS_BOUNDED;
+    const QRRenderOptions *render = &options->render;
+    bool isRenderValid = 0 <= render->format && render->format < OF_COUNT
+        && MIN_SCALE <= render->scale && render->scale <= MAX_SCALE
+        && 0 <= render->quietZone && render->quietZone <= MAX_QUIET_ZONE;
+    if (!isLevelValid || !isVersionValid || !isMaskValid || !isMaskSearchValid || !isRenderValid) {
+        return QR_ERROR_INVALID_OPTIONS;
+    }
+
     ErrorCorrectionLevel forcedLevel = options->forcedLevel;
     int32_t forcedVersion = options->forcedVersion;
     bool isDebug = options->isDebug;
 
-    QR qr = analyse_data(text, textLen, forcedLevel, forcedVersion, isDebug);
+    Workspace *scratch = (Workspace *)workspace->bytes;
+    QRStatus status = analyse_data(text, textLen, forcedLevel, forcedVersion, qr, scratch, isDebug);
+    if (status != QR_OK) {
+        return status;
+    }
 
-    BitVec bv = encode_data(&qr, text, textLen, isDebug);
+    encode_data(qr, text, &scratch->segments, &scratch->bv, isDebug);
 
-    uint8_t codewords[MAX_BLOCKS_COUNT * MAX_BLOCKS_LENGTH] = {};
-    int32_t codewordsCount = prepare_codewords(&qr, &bv, codewords, isDebug);
+    prepare_codewords(qr, &scratch->bv, &scratch->codewords, isDebug);
 
     int32_t forcedMask = options->forcedMask;
-    OutputFormat outputFormat = options->outputFormat;
-    draw_matrix(&qr, codewords, codewordsCount, forcedMask, outputFormat, isDebug);
+    MaskSearch maskSearch = options->maskSearch;
+    draw_matrix(qr, &scratch->codewords, forcedMask, maskSearch, &options->render, isDebug);
 
-    return qr;
+    return QR_OK;
 }
 
+// Prepares the data codeword in serial, with the error correction codewords it contributes.
 internal void
-print_ansi(FILE *out, QR *qr)
+init_serial_codeword(Serial *serial, SerialCodeword *codeword, Codewords *codewords, int32_t dataIndex)
 {
-    for (int32_t row = -QR_FRAME_WIDTH; row < qr->size + QR_FRAME_WIDTH; row++) {
-        for (int32_t column = -QR_FRAME_WIDTH; column < qr->size + QR_FRAME_WIDTH; column++) {
-            if (QR_IS_OUTSIDE(qr, row, column)) {
-                fprintf(out, "\033[47m  \033[0m"); // printing frame
-                continue;
-            }
-            if (QR_MODULE_COLOR(qr, row, column) == MC_LIGHT) {
-                fprintf(out, "\033[47m  \033[0m");
-            }
-            else {
-                fprintf(out, "\033[40m  \033[0m");
-            }
+    // Blocks hold their data codewords in order, the long ones come last.
+    int32_t blocksCount = codewords->blocksCount;
+    int32_t shortBlocksCount = codewords->shortBlocksCount;
+    int32_t errorCodewordsPerBlockCount = codewords->errorCodewordsPerBlockCount;
+    int32_t shortDataLength = codewords->shortBlockLength - errorCodewordsPerBlockCount;
+    int32_t block = 0;
+    int32_t blockIndex = 0;
+    if (dataIndex < shortBlocksCount * shortDataLength) {
+        block = dataIndex / shortDataLength;
+        blockIndex = dataIndex % shortDataLength;
+    }
+    else {
+        int32_t longIndex = dataIndex - shortBlocksCount * shortDataLength;
+        block = shortBlocksCount + longIndex / (shortDataLength + 1);
+        blockIndex = longIndex % (shortDataLength + 1);
+    }
+    int32_t interleavedIndex = (blockIndex < shortDataLength)
+        ? blockIndex * blocksCount + block
+        : shortDataLength * blocksCount + (block - shortBlocksCount);
+    codeword->module = interleavedIndex * 8;
+
+    codeword->blockSlot = 0;
+    while (codeword->blockSlot < serial->blocksCount && serial->blocks[codeword->blockSlot] != block) {
+        codeword->blockSlot++;
+    }
+    if (codeword->blockSlot == serial->blocksCount) {
+        serial->blocks[serial->blocksCount++] = block;
+    }
+
+    GF256Generator generator;
+    init_generator(&generator, serial->base.version, serial->base.level);
+    uint8_t data[MAX_BLOCKS_LENGTH] = {};
+    data[blockIndex] = 1;
+    uint8_t remainder[MAX_GENERATOR_POLYNOM_DEGREE];
+    int32_t blockDataLength = (block < shortBlocksCount) ? shortDataLength : shortDataLength + 1;
+    gf256_rs_remainder(&generator, data, blockDataLength, remainder);
+    for (int32_t n = 0; n < 16; n++) {
+        for (int32_t i = 0; i < errorCodewordsPerBlockCount; i++) {
+            codeword->errorNibbleProducts[0][n][i] = gf256_multiply((uint8_t)n, remainder[i]);
+            codeword->errorNibbleProducts[1][n][i] = gf256_multiply((uint8_t)(n << 4), remainder[i]);
         }
-        fprintf(out, "\n");
     }
 }
 
+// Splits the counter into units and finds where their bits go.
 internal void
-print_ascii(FILE *out, QR *qr)
+init_serial_units(Serial *serial, const char *text, int32_t counterOffset, Segments *segments)
 {
-    for (int32_t row = -QR_FRAME_WIDTH; row < qr->size + QR_FRAME_WIDTH; row++) {
-        for (int32_t column = -QR_FRAME_WIDTH; column < qr->size + QR_FRAME_WIDTH; column++) {
-            if (QR_IS_OUTSIDE(qr, row, column)) {
-                fprintf(out, "  "); // printing frame
-                continue;
+    int32_t version = serial->base.version;
+    int32_t counterEnd = counterOffset + serial->counterWidth;
+    int32_t bit = 0;
+    serial->unitsCount = 0;
+    for (int32_t segmentIndex = 0; segmentIndex < segments->count; segmentIndex++) {
+        Segment *segment = &segments->items[segmentIndex];
+        int32_t groupLen = (segment->mode == EM_NUMERIC) ? 3 : (segment->mode == EM_ALPHANUM) ? 2 : 1;
+        int32_t segmentEnd = segment->offset + segment->length;
+        bit += 4 + LENGTH_BITS_COUNT[segment->mode][version];
+        for (int32_t groupStart = segment->offset; groupStart < segmentEnd; groupStart += groupLen) {
+            int32_t groupEnd = MIN(groupStart + groupLen, segmentEnd);
+            int32_t width = 8;
+            if (segment->mode == EM_NUMERIC) {
+                width = 4 + 3 * (groupEnd - groupStart - 1);
             }
-            if (QR_MODULE_COLOR(qr, row, column) == MC_LIGHT) {
-                fprintf(out, "  ");
+            else if (segment->mode == EM_ALPHANUM) {
+                width = (groupEnd - groupStart == 2) ? 11 : 6;
             }
-            else {
-                fprintf(out, "##");
+
+            int32_t firstChar = MAX(groupStart, counterOffset);
+            int32_t endChar = MIN(groupEnd, counterEnd);
+            if (firstChar < endChar) {
+                SerialUnit *unit = &serial->units[serial->unitsCount++];
+                unit->mode = segment->mode;
+                unit->firstDigit = firstChar - counterOffset;
+                unit->digitsCount = endChar - firstChar;
+                unit->fixedValue = 0;
+                for (int32_t i = groupStart; i < groupEnd; i++) {
+                    uint32_t weight = 1;
+                    if (segment->mode == EM_NUMERIC) {
+                        for (int32_t k = i + 1; k < groupEnd; k++) {
+                            weight *= 10;
+                        }
+                    }
+                    else if (segment->mode == EM_ALPHANUM) {
+                        weight = (i == groupStart && groupEnd - groupStart == 2) ? 45 : 1;
+                    }
+                    bool isCounterDigit = firstChar <= i && i < endChar;
+                    if (isCounterDigit) {
+                        unit->digitWeights[i - firstChar] = weight;
+                    }
+                    if (segment->mode == EM_BYTE) {
+                        unit->fixedValue += (uint32_t)(uint8_t)(isCounterDigit ? '0' : text[i]);
+                    }
+                    else if (!isCounterDigit) {
+                        uint32_t charValue = (segment->mode == EM_NUMERIC) ? (uint32_t)(text[i] - '0')
+                                                                           : pack_alnum_value(text[i]);
+                        unit->fixedValue += weight * charValue;
+                    }
+                }
+                unit->width = width;
+                unit->firstBit = bit;
             }
+            bit += width;
         }
-        fprintf(out, "\n");
     }
 }
 
+// Toggles the bits of the counter in qr, with the error correction codewords they change.
 internal void
-print_utf8(FILE *out, QR *qr) {
-    for (int32_t row = -QR_FRAME_WIDTH; row < qr->size + QR_FRAME_WIDTH; row += 2) {
-        bool isLastRow = row == qr->size - 1;
-        for (int32_t column = -QR_FRAME_WIDTH; column < qr->size + QR_FRAME_WIDTH; column++) {
-            ModuleColor color0;
-            ModuleColor color1;
-            if (QR_IS_OUTSIDE(qr, row, column)) {
-                color0 = MC_LIGHT;
-                color1 = MC_LIGHT;
-            }
-            else {
-                color0 = QR_MODULE_COLOR(qr, row, column);
-                color1 = isLastRow ? MC_LIGHT : QR_MODULE_COLOR(qr, row + 1, column);
-            }
-            int32_t colors = color1 << 1 | color0;
-            switch (colors) {
-                case 0b00: fprintf(out, "█"); break;
-                case 0b01: fprintf(out, "▄"); break;
-                case 0b10: fprintf(out, "▀"); break;
-                case 0b11: fprintf(out, " "); break;
-                default: UNREACHABLE();
-            }
+xor_serial_counter(const Serial *serial, const uint8_t *digits, QR *qr)
+{
+    uint8_t dataDeltas[MAX_SERIAL_CODEWORDS + 2] = {};
+    for (int32_t i = 0; i < serial->unitsCount; i++) {
+        const SerialUnit *unit = &serial->units[i];
+        uint32_t value = unit->fixedValue;
+        for (int32_t j = 0; j < unit->digitsCount; j++) {
+            value += unit->digitWeights[j] * digits[unit->firstDigit + j];
+        }
+        int32_t width = unit->width;
+        int32_t bit = unit->firstBit - serial->firstCodeword * 8;
+        // At most 11 bits from any bit of a byte span three bytes.
+        uint32_t bits = value << (24 - width - bit % 8);
+        dataDeltas[bit / 8] ^= (uint8_t)(bits >> 16);
+        dataDeltas[bit / 8 + 1] ^= (uint8_t)(bits >> 8);
+        dataDeltas[bit / 8 + 2] ^= (uint8_t)bits;
+    }
+
+    const uint16_t *dataModules = get_version_template(qr->version)->dataModules;
+    int32_t errorCodewordsPerBlockCount = serial->errorCodewordsPerBlockCount;
+    uint8_t errorDeltas[MAX_SERIAL_CODEWORDS][MAX_GENERATOR_POLYNOM_DEGREE];
+    memset(errorDeltas, 0, sizeof(errorDeltas[0]) * serial->blocksCount);
+    for (int32_t i = 0; i < serial->codewordsCount; i++) {
+        uint8_t delta = dataDeltas[i];
+        if (delta == 0) {
+            continue;
+        }
+        const SerialCodeword *codeword = &serial->codewords[i];
+        draw_codeword(qr, &dataModules[codeword->module], delta);
+        const uint8_t *lowProducts = codeword->errorNibbleProducts[0][delta & 0xF];
+        const uint8_t *highProducts = codeword->errorNibbleProducts[1][delta >> 4];
+        uint8_t *errorDelta = errorDeltas[codeword->blockSlot];
+        for (int32_t j = 0; j < errorCodewordsPerBlockCount; j++) {
+            errorDelta[j] ^= lowProducts[j] ^ highProducts[j];
+        }
+    }
+    for (int32_t i = 0; i < serial->blocksCount; i++) {
+        for (int32_t j = 0; j < errorCodewordsPerBlockCount; j++) {
+            int32_t index = serial->dataCodewordsCount + j * serial->allBlocksCount + serial->blocks[i];
+            draw_codeword(qr, &dataModules[index * 8], errorDeltas[i][j]);
         }
-        fprintf(out, "\n");
     }
 }
 
-internal void
-print_utf8q(FILE *out, QR *qr) {
-    for (int32_t row = -QR_FRAME_WIDTH; row < qr->size + QR_FRAME_WIDTH; row += 2) {
-        bool isLastRow = row == qr->size - 1;
-        for (int32_t column = -QR_FRAME_WIDTH; column < qr->size + QR_FRAME_WIDTH; column += 2) {
-            ModuleColor color0;
-            ModuleColor color1;
-            ModuleColor color2;
-            ModuleColor color3;
-            if (QR_IS_OUTSIDE(qr, row, column)) {
-                color0 = MC_LIGHT;
-                color1 = MC_LIGHT;
-                color2 = MC_LIGHT;
-                color3 = MC_LIGHT;
-            }
-            else {
-                bool isLastColumn = column == qr->size - 1;
-                color0 = QR_MODULE_COLOR(qr, row, column);
-                color1 = isLastColumn ? MC_LIGHT : QR_MODULE_COLOR(qr, row, column + 1);
-                color2 = isLastRow ? MC_LIGHT : QR_MODULE_COLOR(qr, row + 1, column);
-                color3 = (isLastRow || isLastColumn) ? MC_LIGHT : QR_MODULE_COLOR(qr, row + 1, column + 1);
-            }
-            int32_t colors = color3 << 3 | color2 << 2 | color1 << 1 | color0;
-            switch (colors) {
-                case 0b0000: fprintf(out, "█"); break;
-                case 0b0001: fprintf(out, "▟"); break;
-                case 0b0010: fprintf(out, "▙"); break;
-                case 0b0011: fprintf(out, "▄"); break;
-                case 0b0100: fprintf(out, "▜"); break;
-                case 0b0101: fprintf(out, "▐"); break;
-                case 0b0110: fprintf(out, "▚"); break;
-                case 0b0111: fprintf(out, "▗"); break;
-                case 0b1000: fprintf(out, "▛"); break;
-                case 0b1001: fprintf(out, "▞"); break;
-                case 0b1010: fprintf(out, "▌"); break;
-                case 0b1011: fprintf(out, "▖"); break;
-                case 0b1100: fprintf(out, "▀"); break;
-                case 0b1101: fprintf(out, "▝"); break;
-                case 0b1110: fprintf(out, "▘"); break;
-                case 0b1111: fprintf(out, " "); break;
-                default: UNREACHABLE();
-            }
+QRStatus
+qr_serial_init(QRSerial *serialMemory, const char *text, int32_t textLen, int32_t counterOffset, int32_t counterWidth,
+               const QROptions *options, QRWorkspace *workspace)
+{
+    if (serialMemory == NULL || options == NULL || workspace == NULL) {
+        return QR_ERROR_NULL_ARGUMENT;
+    }
+    if (text == NULL || textLen <= 0) {
+        return QR_ERROR_EMPTY_TEXT;
+    }
+    if (textLen > MAX_TEXT_LEN) {
+        return QR_ERROR_TEXT_TOO_LONG;
+    }
+    if (counterWidth < 1 || counterWidth > MAX_SERIAL_WIDTH || counterOffset < 0
+        || counterOffset > textLen - counterWidth) {
+        return QR_ERROR_INVALID_OPTIONS;
+    }
+    for (int32_t i = counterOffset; i < counterOffset + counterWidth; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return QR_ERROR_INVALID_OPTIONS;
         }
-        fprintf(out, "\n");
     }
+
+    Serial *serial = (Serial *)serialMemory->bytes;
+    QRStatus status = qr_encode(text, textLen, options, workspace, &serial->base);
+    if (status != QR_OK) {
+        return status;
+    }
+
+    // Every counter has the same character classes, so the segments and the version of the text fit all of them,
+    // and qr_encode left them in the workspace.
+    Workspace *scratch = (Workspace *)workspace->bytes;
+    Codewords *codewords = &scratch->codewords;
+    serial->counterWidth = counterWidth;
+    serial->countersCount = 1;
+    for (int32_t i = 0; i < counterWidth; i++) {
+        serial->countersCount *= 10;
+    }
+    serial->allBlocksCount = codewords->blocksCount;
+    serial->dataCodewordsCount = codewords->dataCodewordsCount;
+    serial->errorCodewordsPerBlockCount = codewords->errorCodewordsPerBlockCount;
+    init_serial_units(serial, text, counterOffset, &scratch->segments);
+
+    // Counter bits reach from the first unit to the end of the last one.
+    const SerialUnit *lastUnit = &serial->units[serial->unitsCount - 1];
+    int32_t endBit = lastUnit->firstBit + lastUnit->width;
+    serial->firstCodeword = serial->units[0].firstBit / 8;
+    serial->codewordsCount = (endBit - 1) / 8 + 1 - serial->firstCodeword;
+    if (serial->codewordsCount > MAX_SERIAL_CODEWORDS) {
+        return QR_ERROR_INVALID_OPTIONS;
+    }
+    serial->blocksCount = 0;
+    for (int32_t i = 0; i < serial->codewordsCount; i++) {
+        init_serial_codeword(serial, &serial->codewords[i], codewords, serial->firstCodeword + i);
+    }
+
+    // Toggling the counter of the text clears its bits.
+    uint8_t digits[MAX_SERIAL_WIDTH];
+    for (int32_t i = 0; i < counterWidth; i++) {
+        digits[i] = (uint8_t)(text[counterOffset + i] - '0');
+    }
+    xor_serial_counter(serial, digits, &serial->base);
+    return QR_OK;
+}
+
+QRStatus
+qr_serial_encode(const QRSerial *serialMemory, int64_t counter, QR *qr)
+{
+    if (serialMemory == NULL || qr == NULL) {
+        return QR_ERROR_NULL_ARGUMENT;
+    }
+    const Serial *serial = (const Serial *)serialMemory->bytes;
+    if (counter < 0 || counter >= serial->countersCount) {
+        return QR_ERROR_INVALID_OPTIONS;
+    }
+    uint8_t digits[MAX_SERIAL_WIDTH];
+    for (int32_t i = serial->counterWidth - 1; i >= 0; i--) {
+        digits[i] = (uint8_t)(counter % 10);
+        counter /= 10;
+    }
+
+    copy_qr(qr, &serial->base);
+    qr->mask = serial->base.mask;
+    qr->penalty = -1;
+    xor_serial_counter(serial, digits, qr);
+    return QR_OK;
+}
+
+QRStatus
+qr_profile_init(QRProfile *profileMemory, EncodingMode mode, int32_t version, ErrorCorrectionLevel level, int32_t mask)
+{
+    if (profileMemory == NULL) {
+        return QR_ERROR_NULL_ARGUMENT;
+    }
+    if (mode < 0 || mode >= EM_COUNT || version < MIN_VERSION || version > MAX_VERSION || level < ECL_LOW
+        || level > ECL_HIGH || mask < MIN_MASK || mask > MAX_MASK) {
+        return QR_ERROR_INVALID_OPTIONS;
+    }
+
+    Profile *profile = (Profile *)profileMemory->bytes;
+    profile->mode = mode;
+    init_generator(&profile->generator, version, level);
+
+    // The longest text whose single segment fits.
+    int32_t lengthBitsCount = LENGTH_BITS_COUNT[mode][version];
+    int32_t dataBitsCount = calc_data_codewords_count(version, level) * 8 - 4 - lengthBitsCount;
+    int32_t maxTextLen = 0;
+    if (mode == EM_NUMERIC) {
+        maxTextLen = dataBitsCount / 10 * 3 + ((dataBitsCount % 10 >= 7) ? 2 : (dataBitsCount % 10 >= 4) ? 1 : 0);
+    }
+    else if (mode == EM_ALPHANUM) {
+        maxTextLen = dataBitsCount / 11 * 2 + ((dataBitsCount % 11 >= 6) ? 1 : 0);
+    }
+    else {
+        maxTextLen = dataBitsCount / 8;
+    }
+    profile->maxTextLen = MIN(MIN(maxTextLen, (1 << lengthBitsCount) - 1), MAX_TEXT_LEN);
+
+    QR *start = &profile->start;
+    start->mode = mode;
+    start->level = level;
+    start->version = version;
+    start->mask = mask;
+    start->penalty = -1;
+    start->size = 4 * version + 21;
+    start->rowWords = QR_ROW_WORDS(start->size);
+    draw_template(start);
+    apply_mask(start, mask);
+    draw_format_modules(start, mask);
+    draw_version_modules(start);
+    return QR_OK;
+}
+
+QRStatus
+qr_profile_encode(const QRProfile *profileMemory, const char *text, int32_t textLen, QRWorkspace *workspace, QR *qr)
+{
+    if (profileMemory == NULL || workspace == NULL || qr == NULL) {
+        return QR_ERROR_NULL_ARGUMENT;
+    }
+    if (text == NULL || textLen <= 0) {
+        return QR_ERROR_EMPTY_TEXT;
+    }
+    if (textLen > MAX_TEXT_LEN) {
+        return QR_ERROR_TEXT_TOO_LONG;
+    }
+    const Profile *profile = (const Profile *)profileMemory->bytes;
+    if (textLen > profile->maxTextLen) {
+        return QR_ERROR_VERSION_TOO_SMALL;
+    }
+    Workspace *scratch = (Workspace *)workspace->bytes;
+    if (profile->mode != EM_BYTE) {
+        classify_text(text, textLen, &scratch->runs);
+        if (scratch->runs.mode > profile->mode) {
+            return QR_ERROR_MODE_MISMATCH;
+        }
+    }
+
+    Segments *segments = &scratch->segments;
+    segments->items[0] = (Segment){.mode = profile->mode, .offset = 0, .length = textLen};
+    segments->count = 1;
+    segments->bitsCount = calc_segment_bits(profile->mode, textLen, profile->start.version);
+    copy_qr(qr, &profile->start);
+    qr->mask = profile->start.mask;
+    qr->penalty = -1;
+    encode_data(qr, text, segments, &scratch->bv, false);
+    fill_codewords(qr, scratch->bv.bytes, &profile->generator, &scratch->codewords);
+    draw_data(qr, &scratch->codewords);
+    return QR_OK;
 }
 
-void
-qr_print(FILE *out, QR *qr, OutputFormat outputFormat)
+const char *
+qr_status_message(QRStatus status)
 {
-    switch (outputFormat) {
-        case OF_ANSI: print_ansi(out, qr); break;
-        case OF_ASCII: print_ascii(out, qr); break;
-        case OF_UTF8: print_utf8(out, qr); break;
-        case OF_UTF8Q: print_utf8q(out, qr); break;
-        default: UNREACHABLE();
+    if (status < 0 || status >= QR_STATUS_COUNT) {
+        return "unknown status";
     }
+    return QR_STATUS_MESSAGES[status];
 }
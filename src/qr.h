@@ -1,9 +1,18 @@
 #ifndef QR_H
 #define QR_H
 
+#include <stdalign.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Marks the symbols libqr.so exports, everything else is built with hidden visibility.
+#define QR_API __attribute__((visibility("default")))
+
 #define MIN_VERSION 0
 #define MAX_VERSION 39
 #define VERSION_COUNT 40
@@ -16,12 +25,15 @@
 #define MASK_COUNT 8
 #define MASK_INVALID (-1)
 
-#define MAX_TEXT_LEN 7089 // = MAX_CHAR_COUNT[EM_NUMERIC][ECL_LOW][MAX_VERSION]
+#define MAX_TEXT_LEN 7089 // = numeric characters that fit into version 40-L
 
-#define MAX_MODULE_COUNT 31329 // = (4 × MaxVersion + 21) * (4 × MaxVersion + 21)
+#define MAX_SIZE 177 // = 4 × MaxVersion + 21
+#define MAX_ROW_WORDS 3 // = ceil(MaxSize / 64)
+#define MAX_MATRIX_WORDS 531 // = MaxSize × MaxRowWords
 
+// The enums are untagged because C++ does not let a tag share the name of its typedef.
 typedef int32_t EncodingMode;
-enum EncodingMode
+enum
 {
     EM_NUMERIC,
     EM_ALPHANUM,
@@ -31,15 +43,10 @@ enum EncodingMode
     EM_COUNT,
 };
 
-global const char *const EncodingModeNames[EM_COUNT] = {
-    "NUMERIC",
-    "ALPHANUMERIC",
-    "BYTE",
-    //"KANJI",
-};
+extern QR_API const char *const EncodingModeNames[EM_COUNT];
 
 typedef int32_t ErrorCorrectionLevel;
-enum ErrorCorrectionLevel
+enum
 {
     ECL_LOW,      // ~7%
     ECL_MEDIUM,   // ~15%
@@ -49,67 +56,192 @@ enum ErrorCorrectionLevel
     ECL_COUNT,
 };
 
-global const char *const ErrorCorrectionLevelNames[ECL_COUNT] = {
-    "LOW",
-    "MEDIUM",
-    "QUARTILE",
-    "HIGH",
-};
-
-typedef int32_t ModuleType;
-enum ModuleType
-{
-    MT_NONE,
-    MT_DATA,
-    MT_FUNCTIONAL,
-};
+extern QR_API const char *const ErrorCorrectionLevelNames[ECL_COUNT];
 
 typedef int32_t ModuleColor;
-enum ModuleColor
+enum
 {
     MC_LIGHT = 0,
     MC_DARK = 1,
 };
 
-typedef struct ModuleValue ModuleValue;
-struct ModuleValue
-{
-    ModuleType type;
-    ModuleColor color;
-};
-
 typedef int32_t OutputFormat;
-enum OutputFormat
+enum
 {
     OF_ANSI,
     OF_ASCII,
     OF_UTF8,
     OF_UTF8Q,
+    OF_ANSI_RLE,   // one colour escape per run of modules
+    OF_ANSI_RGB,   // OF_ANSI_RLE with 24-bit colours
+    OF_ANSI_HALF,  // two rows per line of coloured upper half blocks
+    OF_PBM,        // binary bitmap
+    OF_PGM,        // binary 8-bit greymap
+    OF_PNG,        // 1-bit greyscale, fixed Huffman codes
+    OF_PNG_STORED, // OF_PNG without compression, for the lowest latency
+    OF_SVG,        // a single path of merged rectangles
+    OF_SVG_CRISP,  // OF_SVG rendered without anti-aliasing
+
+    OF_COUNT,
+};
+
+extern QR_API const char *const OutputFormatNames[OF_COUNT];
+
+typedef int32_t MaskSearch;
+enum
+{
+    MS_SEQUENTIAL, // Score masks one after another on the same matrix.
+    MS_PARALLEL,   // Score masks concurrently on private copies of the matrix.
+    MS_BOUNDED,    // Skip the expensive rules for masks that cannot beat the best penalty so far.
+};
+
+typedef int32_t QRStatus;
+enum
+{
+    QR_OK,
+    QR_ERROR_NULL_ARGUMENT,
+    QR_ERROR_EMPTY_TEXT,
+    QR_ERROR_TEXT_TOO_LONG,     // more than MAX_TEXT_LEN bytes
+    QR_ERROR_INVALID_OPTIONS,   // an option is out of its range
+    QR_ERROR_NO_VERSION_FITS,   // the text needs more than version 40 at the error correction level
+    QR_ERROR_VERSION_TOO_SMALL, // the text needs more than the forced version at the error correction level
+    QR_ERROR_MODE_MISMATCH,     // the text has characters outside the encoding mode of a profile
+
+    QR_STATUS_COUNT,
+};
+
+#define MIN_SCALE 1
+#define MAX_SCALE 32
+#define DEFAULT_QUIET_ZONE 4
+#define MAX_QUIET_ZONE 32
+
+typedef struct QRRenderOptions QRRenderOptions;
+struct QRRenderOptions
+{
+    OutputFormat format;
+    int32_t scale;     // pixels per module of images, the size of SVGs, from MIN_SCALE to MAX_SCALE
+    int32_t quietZone; // light modules around the symbol, up to MAX_QUIET_ZONE
 };
 
 typedef struct QROptions QROptions;
 struct QROptions
 {
-    char text[MAX_TEXT_LEN + 1];
-    int32_t textLen;
     ErrorCorrectionLevel forcedLevel;
     int32_t forcedVersion;
     int32_t forcedMask;
-    OutputFormat outputFormat;
+    MaskSearch maskSearch;
+    QRRenderOptions render; // of the debugging output
     bool isDebug;
 };
 
 typedef struct QR QR;
 struct QR
 {
-    ModuleValue matrix[MAX_MODULE_COUNT];
+    // Row-major bitboards, module (row, column) is bit (column % 64) of word (row * rowWords + column / 64).
+    // Bits past the last column of a row are always zero.
+    uint64_t colors[MAX_MATRIX_WORDS];     // set == MC_DARK
+    uint64_t functional[MAX_MATRIX_WORDS]; // set == MT_FUNCTIONAL
     int32_t size;
-    EncodingMode mode;
+    int32_t rowWords;
+    EncodingMode mode; // widest mode of all segments
     ErrorCorrectionLevel level;
     int32_t version;
+    int32_t mask;
+    int32_t penalty; // of the applied mask
+};
+
+#define QR_WORKSPACE_SIZE (112 * 1024)
+
+// Scratch memory of qr_encode. Needs no initialisation and can be reused by any number of calls,
+// but by one call at a time, so give every thread its own.
+typedef struct QRWorkspace QRWorkspace;
+struct QRWorkspace
+{
+    alignas(64) unsigned char bytes[QR_WORKSPACE_SIZE];
+};
+
+// Encodes textLen bytes of text. Returns QR_OK and fills qr, or an error and leaves qr undefined.
+// Only the words of the matrix within qr->size are written.
+// Safe to call from several threads at once with different workspaces.
+QR_API QRStatus qr_encode(const char *text, int32_t textLen, const QROptions *options, QRWorkspace *workspace, QR *qr);
+QR_API const char *qr_status_message(QRStatus status);
+
+#define QR_PROFILE_SIZE (12 * 1024)
+
+// Pins the mode, version, level and mask of symbols, so encoding skips the analysis of the text and the mask search
+// and starts from a matrix that already holds the function patterns, format and version modules and mask.
+// Texts are encoded as a single segment in the mode. Needs no cleanup.
+typedef struct QRProfile QRProfile;
+struct QRProfile
+{
+    alignas(64) unsigned char bytes[QR_PROFILE_SIZE];
+};
+
+QR_API QRStatus qr_profile_init(QRProfile *profile, EncodingMode mode, int32_t version, ErrorCorrectionLevel level,
+                                int32_t mask);
+// Same as qr_encode with the pinned options, except that the penalty of the symbols is not scored and left -1.
+// Returns QR_ERROR_MODE_MISMATCH for texts the mode cannot encode. Safe to call from several threads at once.
+QR_API QRStatus qr_profile_encode(const QRProfile *profile, const char *text, int32_t textLen, QRWorkspace *workspace,
+                                  QR *qr);
+
+#define MAX_SERIAL_WIDTH 18 // digits of the largest counter that fits into int64_t
+#define QR_SERIAL_SIZE (40 * 1024)
+
+// Encodes runs of texts that differ only in a decimal counter, such as serial numbers. The text is analysed once and
+// every symbol only redraws the data codewords its counter changes and the error correction codewords of their blocks,
+// so all symbols keep the version, level and mask of the first one. Needs no cleanup.
+typedef struct QRSerial QRSerial;
+struct QRSerial
+{
+    alignas(64) unsigned char bytes[QR_SERIAL_SIZE];
+};
+
+// Prepares serial for text, whose counterWidth bytes at counterOffset are the counter, zero-padded decimal digits.
+// Encodes text as qr_encode does with options and workspace, which is free again afterwards. Returns
+// QR_ERROR_INVALID_OPTIONS when the counter is not all digits, or spreads over more bits than serial can track.
+QR_API QRStatus qr_serial_init(QRSerial *serial, const char *text, int32_t textLen, int32_t counterOffset,
+                               int32_t counterWidth, const QROptions *options, QRWorkspace *workspace);
+// Fills qr with the symbol of the text with counter in place of the counter digits. Returns QR_ERROR_INVALID_OPTIONS
+// for a counter that is negative or has more digits than the counter width. The penalty of the symbols is not scored
+// and left -1. Safe to call from several threads at once.
+QR_API QRStatus qr_serial_encode(const QRSerial *serial, int64_t counter, QR *qr);
+
+// Renders qr as text or as an image. Returns the exact number of bytes the rendering takes and writes them into
+// buffer when bufferSize is large enough, otherwise buffer may hold part of them. A NULL buffer queries the size.
+// Returns 0 for invalid options. Text is not NUL-terminated.
+QR_API size_t qr_render(const QR *qr, const QRRenderOptions *options, char *buffer, size_t bufferSize);
+QR_API void qr_print(FILE *out, const QR *qr, const QRRenderOptions *options);
+
+// Keeps encoded symbols, and optionally their rendering, in caller-owned memory, evicting the least recently used ones
+// to stay within it. Keyed by the text and the forced level, version and mask. Safe to share between threads.
+typedef struct QRCache QRCache;
+
+typedef struct QRCacheStats QRCacheStats;
+struct QRCacheStats
+{
+    int64_t hits;
+    int64_t misses;
+    int64_t evictions;
+    int32_t entriesCount;
+    size_t usedBytes;
+    size_t budgetBytes;
 };
 
-QR qr_encode(QROptions *options);
-void qr_print(FILE *out, QR *qr, OutputFormat outputFormat);
+// Sets up a cache in memorySize bytes of memory, which must outlive it. Returns NULL if the memory is too small.
+QR_API QRCache *qr_cache_init(void *memory, size_t memorySize);
+// Same as qr_encode, but a hit copies the cached symbol instead of encoding it and prints no debugging messages.
+// A NULL cache encodes every call.
+QR_API QRStatus qr_cache_encode(QRCache *cache, const char *text, int32_t textLen, const QROptions *options,
+                                QRWorkspace *workspace, QR *qr);
+// Same as qr_cache_encode followed by qr_render with options->render into buffer. Also caches the rendering when it
+// fits into buffer, so a later hit with the same render options skips rendering too.
+QR_API QRStatus qr_cache_encode_rendered(QRCache *cache, const char *text, int32_t textLen, const QROptions *options,
+                                         QRWorkspace *workspace, QR *qr, char *buffer, size_t bufferSize,
+                                         size_t *renderedSize);
+QR_API QRCacheStats qr_cache_stats(QRCache *cache);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif //QR_H
@@ -0,0 +1,135 @@
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define RASTER_SIMD 1
+#endif
+
+#include "utils.h"
+#include "raster.h"
+
+#if RASTER_SIMD
+
+// Both expansion kernels copy byte k / 8 of the row bits into byte k of the block and test its bit k % 8.
+
+global const uint8_t BIT_MASKS[16] = {
+    1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128,
+};
+global const int8_t BYTE_SPREAD[32] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3,
+};
+
+internal int32_t
+expand_bits_sse2(const uint8_t *bits, int32_t count, uint8_t *masks)
+{
+    __m128i bitMasks = _mm_loadu_si128((__m128i *)BIT_MASKS);
+    int32_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i spread = _mm_unpacklo_epi64(_mm_set1_epi8((char)bits[i / 8]), _mm_set1_epi8((char)bits[i / 8 + 1]));
+        __m128i isSet = _mm_cmpeq_epi8(_mm_and_si128(spread, bitMasks), bitMasks);
+        _mm_storeu_si128((__m128i *)(masks + i), isSet);
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) internal int32_t
+expand_bits_avx2(const uint8_t *bits, int32_t count, uint8_t *masks)
+{
+    __m256i bitMasks = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)BIT_MASKS));
+    __m256i byteSpread = _mm256_loadu_si256((__m256i *)BYTE_SPREAD);
+    int32_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        int32_t block;
+        memcpy(&block, bits + i / 8, sizeof(block));
+        __m256i spread = _mm256_shuffle_epi8(_mm256_set1_epi32(block), byteSpread);
+        __m256i isSet = _mm256_cmpeq_epi8(_mm256_and_si256(spread, bitMasks), bitMasks);
+        _mm256_storeu_si256((__m256i *)(masks + i), isSet);
+    }
+    return i;
+}
+
+// Both packing kernels reverse every 8 masks so the movemask puts the first one into the highest bit.
+
+global const int8_t BYTE_REVERSE[16] = {
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+};
+
+__attribute__((target("ssse3"))) internal int32_t
+pack_bits_ssse3(const uint8_t *masks, int32_t count, uint8_t *bytes)
+{
+    __m128i reverse = _mm_loadu_si128((__m128i *)BYTE_REVERSE);
+    int32_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i block = _mm_shuffle_epi8(_mm_loadu_si128((__m128i *)(masks + i)), reverse);
+        uint16_t packed = (uint16_t)_mm_movemask_epi8(block);
+        memcpy(bytes + i / 8, &packed, sizeof(packed));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) internal int32_t
+pack_bits_avx2(const uint8_t *masks, int32_t count, uint8_t *bytes)
+{
+    __m256i reverse = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *)BYTE_REVERSE));
+    int32_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i block = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(masks + i)), reverse);
+        uint32_t packed = (uint32_t)_mm256_movemask_epi8(block);
+        memcpy(bytes + i / 8, &packed, sizeof(packed));
+    }
+    return i;
+}
+
+#endif
+
+void
+raster_expand_bits(const uint64_t *words, int32_t count, uint8_t *masks)
+{
+    int32_t i = 0;
+#if RASTER_SIMD
+    // x86 is little-endian, so bit i of the words is bit i % 8 of byte i / 8.
+    const uint8_t *bits = (const uint8_t *)words;
+    if (__builtin_cpu_supports("avx2")) {
+        i = expand_bits_avx2(bits, count, masks);
+    }
+    i += expand_bits_sse2(bits + i / 8, count - i, masks + i);
+#endif
+    for (; i < count; i++) {
+        masks[i] = (uint8_t)-(int32_t)((words[i / 64] >> (i % 64)) & 1);
+    }
+}
+
+void
+raster_scale(const uint8_t *masks, int32_t count, int32_t scale, uint8_t *pixels)
+{
+    if (scale == 1) {
+        memcpy(pixels, masks, (size_t)count);
+        return;
+    }
+    for (int32_t i = 0; i < count; i++) {
+        memset(pixels + i * scale, masks[i], (size_t)scale);
+    }
+}
+
+void
+raster_pack_bits(const uint8_t *masks, int32_t count, uint8_t *bytes)
+{
+    int32_t i = 0;
+#if RASTER_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        i = pack_bits_avx2(masks, count, bytes);
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        i += pack_bits_ssse3(masks + i, count - i, bytes + i / 8);
+    }
+#endif
+    for (; i < count; i += 8) {
+        uint8_t byte = 0;
+        for (int32_t k = 0; k < 8; k++) {
+            uint8_t mask = (i + k < count) ? masks[i + k] : 0;
+            byte |= (uint8_t)((mask & 1) << (7 - k));
+        }
+        bytes[i / 8] = byte;
+    }
+}
@@ -0,0 +1,13 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <stdint.h>
+
+// Sets masks[i] to 0xFF when bit i of the row is set and to 0 otherwise.
+void raster_expand_bits(const uint64_t *words, int32_t count, uint8_t *masks);
+// Repeats every mask scale times.
+void raster_scale(const uint8_t *masks, int32_t count, int32_t scale, uint8_t *pixels);
+// Packs count masks into ceil(count / 8) bytes, the first one into the highest bit as PBM rows do.
+void raster_pack_bits(const uint8_t *masks, int32_t count, uint8_t *bytes);
+
+#endif //RASTER_H
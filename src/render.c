@@ -0,0 +1,567 @@
+#include <string.h>
+
+#include "utils.h"
+#include "qr.h"
+#include "png.h"
+#include "raster.h"
+
+#define MAX_GLYPH_LEN 19 // = strlen("\033[48;2;255;255;255m")
+#define MAX_LINE_LEN (2 * MAX_GLYPH_LEN * (MAX_SIZE + 2 * MAX_QUIET_ZONE) + MAX_GLYPH_LEN + 1)
+
+#define MAX_IMAGE_WIDTH ((MAX_SIZE + 2 * MAX_QUIET_ZONE) * MAX_SCALE)
+#define MAX_HEADER_LEN 32
+#define MAX_SVG_HEADER_LEN 512
+
+#define PNG_IDAT_LEN (1 << 15)
+
+#define RENDER_BUFFER_SIZE (1 << 16)
+
+static_assert(MAX_LINE_LEN <= RENDER_BUFFER_SIZE);
+static_assert(MAX_IMAGE_WIDTH <= RENDER_BUFFER_SIZE);
+static_assert(1 + (MAX_IMAGE_WIDTH + 7) / 8 <= PNG_MAX_ROW_LEN);
+static_assert(PNG_MAX_DEFLATE_ROW_LEN <= PNG_IDAT_LEN);
+
+typedef struct Glyph Glyph;
+struct Glyph
+{
+    char bytes[MAX_GLYPH_LEN + 1];
+    int32_t len;
+};
+
+// A glyph covers glyphRows × glyphColumns modules. Its code has bit (dy * glyphColumns + dx) set
+// when the module at (row + dy, column + dx) is dark, modules outside of the symbol are light.
+// escapes[code] precedes a glyph whose code differs from the previous one on the line,
+// so run-length formats put their colours there and lineEnd resets them.
+typedef struct RenderLayout RenderLayout;
+struct RenderLayout
+{
+    int32_t glyphRows;
+    int32_t glyphColumns;
+    int32_t maxGlyphLen; // of an escape and a glyph together, 0 for images
+    Glyph glyphs[16];
+    Glyph escapes[16];
+    Glyph lineEnd;
+};
+
+global const RenderLayout RENDER_LAYOUTS[OF_COUNT] = {
+    [OF_ANSI] = {
+        .glyphRows = 1,
+        .glyphColumns = 1,
+        .maxGlyphLen = 11,
+        .glyphs = {
+            {"\033[47m  \033[0m", 11},
+            {"\033[40m  \033[0m", 11},
+        },
+    },
+    [OF_ASCII] = {
+        .glyphRows = 1,
+        .glyphColumns = 1,
+        .maxGlyphLen = 2,
+        .glyphs = {
+            {"  ", 2},
+            {"##", 2},
+        },
+    },
+    // Glyphs draw the light modules, for terminals with a dark background.
+    [OF_UTF8] = {
+        .glyphRows = 2,
+        .glyphColumns = 1,
+        .maxGlyphLen = 3,
+        .glyphs = {
+            {"█", 3}, {"▄", 3}, {"▀", 3}, {" ", 1},
+        },
+    },
+    [OF_UTF8Q] = {
+        .glyphRows = 2,
+        .glyphColumns = 2,
+        .maxGlyphLen = 3,
+        .glyphs = {
+            {"█", 3}, {"▟", 3}, {"▙", 3}, {"▄", 3},
+            {"▜", 3}, {"▐", 3}, {"▚", 3}, {"▗", 3},
+            {"▛", 3}, {"▞", 3}, {"▌", 3}, {"▖", 3},
+            {"▀", 3}, {"▝", 3}, {"▘", 3}, {" ", 1},
+        },
+    },
+    [OF_ANSI_RLE] = {
+        .glyphRows = 1,
+        .glyphColumns = 1,
+        .maxGlyphLen = 7,
+        .glyphs = {
+            {"  ", 2},
+            {"  ", 2},
+        },
+        .escapes = {
+            {"\033[47m", 5},
+            {"\033[40m", 5},
+        },
+        .lineEnd = {"\033[0m", 4},
+    },
+    [OF_ANSI_RGB] = {
+        .glyphRows = 1,
+        .glyphColumns = 1,
+        .maxGlyphLen = 21,
+        .glyphs = {
+            {"  ", 2},
+            {"  ", 2},
+        },
+        .escapes = {
+            {"\033[48;2;255;255;255m", 19},
+            {"\033[48;2;0;0;0m", 13},
+        },
+        .lineEnd = {"\033[0m", 4},
+    },
+    // The upper half block takes the colour of the top module and its background that of the bottom one.
+    [OF_ANSI_HALF] = {
+        .glyphRows = 2,
+        .glyphColumns = 1,
+        .maxGlyphLen = 11,
+        .glyphs = {
+            {"▀", 3}, {"▀", 3}, {"▀", 3}, {"▀", 3},
+        },
+        .escapes = {
+            {"\033[37;47m", 8},
+            {"\033[30;47m", 8},
+            {"\033[37;40m", 8},
+            {"\033[30;40m", 8},
+        },
+        .lineEnd = {"\033[0m", 4},
+    },
+};
+
+internal int32_t
+module_color(const QR *qr, int32_t row, int32_t column)
+{
+    if (row < 0 || row >= qr->size || column < 0 || column >= qr->size) {
+        return MC_LIGHT;
+    }
+    return (int32_t)((qr->colors[row * qr->rowWords + column / 64] >> (column % 64)) & 1);
+}
+
+internal int32_t
+get_code(const QR *qr, const RenderLayout *layout, int32_t row, int32_t column)
+{
+    int32_t code = 0;
+    for (int32_t dy = 0; dy < layout->glyphRows; dy++) {
+        for (int32_t dx = 0; dx < layout->glyphColumns; dx++) {
+            code |= module_color(qr, row + dy, column + dx) << (dy * layout->glyphColumns + dx);
+        }
+    }
+    return code;
+}
+
+internal int32_t
+line_len(const QR *qr, const RenderLayout *layout, int32_t quietZone, int32_t row)
+{
+    int32_t len = layout->lineEnd.len + 1; // '\n'
+    int32_t previousCode = -1;
+    for (int32_t column = -quietZone; column < qr->size + quietZone; column += layout->glyphColumns) {
+        int32_t code = get_code(qr, layout, row, column);
+        if (code != previousCode) {
+            len += layout->escapes[code].len;
+            previousCode = code;
+        }
+        len += layout->glyphs[code].len;
+    }
+    return len;
+}
+
+// Writes the line of glyphs starting at the given row, returns its length.
+internal int32_t
+render_line(const QR *qr, const RenderLayout *layout, int32_t quietZone, int32_t row, char *out)
+{
+    char *end = out;
+    int32_t previousCode = -1;
+    for (int32_t column = -quietZone; column < qr->size + quietZone; column += layout->glyphColumns) {
+        int32_t code = get_code(qr, layout, row, column);
+        if (code != previousCode) {
+            const Glyph *escape = &layout->escapes[code];
+            memcpy(end, escape->bytes, (size_t)escape->len);
+            end += escape->len;
+            previousCode = code;
+        }
+        const Glyph *glyph = &layout->glyphs[code];
+        memcpy(end, glyph->bytes, (size_t)glyph->len);
+        end += glyph->len;
+    }
+    memcpy(end, layout->lineEnd.bytes, (size_t)layout->lineEnd.len);
+    end += layout->lineEnd.len;
+    *end++ = '\n';
+    return (int32_t)(end - out);
+}
+
+// Collects the output, either in a caller buffer that fits all of it or in a buffer that is flushed
+// into out whenever it fills up. Without out, flushing only counts the bytes, except that a bounded sink
+// starts in the caller buffer and, once the next piece might not fit there, goes on in its spill buffer
+// and flushes into the rest of the caller buffer as far as it fits.
+typedef struct RenderSink RenderSink;
+struct RenderSink
+{
+    FILE *out;
+    bool isStreaming;
+    char *bytes;
+    size_t len;
+    size_t cap;
+    size_t flushedLen;
+    char *spill;       // RENDER_BUFFER_SIZE bytes a bounded sink goes on in, NULL once it does
+    char *target;      // caller buffer a bounded sink flushes into
+    size_t targetSize;
+};
+
+internal void
+sink_flush(RenderSink *sink)
+{
+    if (sink->out != NULL) {
+        fwrite(sink->bytes, 1, sink->len, sink->out);
+    }
+    else if (sink->flushedLen < sink->targetSize) {
+        memcpy(sink->target + sink->flushedLen, sink->bytes, MIN(sink->len, sink->targetSize - sink->flushedLen));
+    }
+    sink->flushedLen += sink->len;
+    sink->len = 0;
+}
+
+// Returns room for up to len bytes, the caller adds the ones it wrote to sink->len.
+internal char *
+sink_reserve(RenderSink *sink, size_t len)
+{
+    if (sink->isStreaming && sink->len + len > sink->cap) {
+        if (sink->spill != NULL) {
+            sink->target = sink->bytes;
+            sink->targetSize = sink->cap;
+            sink->flushedLen = sink->len;
+            sink->bytes = sink->spill;
+            sink->len = 0;
+            sink->cap = RENDER_BUFFER_SIZE;
+            sink->spill = NULL;
+        }
+        else {
+            sink_flush(sink);
+        }
+    }
+    return sink->bytes + sink->len;
+}
+
+internal size_t
+text_size(const QR *qr, const QRRenderOptions *options)
+{
+    const RenderLayout *layout = &RENDER_LAYOUTS[options->format];
+    int32_t quietZone = options->quietZone;
+    size_t size = 0;
+    for (int32_t row = -quietZone; row < qr->size + quietZone; row += layout->glyphRows) {
+        size += (size_t)line_len(qr, layout, quietZone, row);
+    }
+    return size;
+}
+
+internal void
+render_text(const QR *qr, const QRRenderOptions *options, RenderSink *sink)
+{
+    const RenderLayout *layout = &RENDER_LAYOUTS[options->format];
+    int32_t quietZone = options->quietZone;
+    int32_t glyphsCount = (qr->size + 2 * quietZone + layout->glyphColumns - 1) / layout->glyphColumns;
+    int32_t maxLineLen = glyphsCount * layout->maxGlyphLen + layout->lineEnd.len + 1;
+    for (int32_t row = -quietZone; row < qr->size + quietZone; row += layout->glyphRows) {
+        char *line = sink_reserve(sink, (size_t)maxLineLen);
+        sink->len += (size_t)render_line(qr, layout, quietZone, row, line);
+    }
+}
+
+// Images are square, width pixels wide and high. PBM rows take a bit per pixel, set for black,
+// PGM rows a byte, 0 for black, and PNG rows a filter byte and a bit per pixel, 0 for black.
+
+internal int32_t
+image_width(const QR *qr, const QRRenderOptions *options)
+{
+    return (qr->size + 2 * options->quietZone) * options->scale;
+}
+
+internal int32_t
+scanline_len(const QRRenderOptions *options, int32_t width)
+{
+    return (options->format == OF_PGM) ? width : (width + 7) / 8;
+}
+
+internal int32_t
+image_header(const QRRenderOptions *options, int32_t width, char *header)
+{
+    if (options->format == OF_PBM) {
+        return snprintf(header, MAX_HEADER_LEN, "P4\n%d %d\n", width, width);
+    }
+    return snprintf(header, MAX_HEADER_LEN, "P5\n%d %d\n255\n", width, width);
+}
+
+internal size_t
+image_size(const QR *qr, const QRRenderOptions *options)
+{
+    char header[MAX_HEADER_LEN];
+    int32_t width = image_width(qr, options);
+    return (size_t)image_header(options, width, header) + (size_t)width * (size_t)scanline_len(options, width);
+}
+
+// Writes the pixels of a module row, scaled horizontally, into scanline.
+internal void
+image_scanline(const QR *qr, const QRRenderOptions *options, int32_t row, uint8_t *scanline)
+{
+    int32_t quietZone = options->quietZone;
+    int32_t modulesCount = qr->size + 2 * quietZone;
+    uint8_t masks[MAX_SIZE + 2 * MAX_QUIET_ZONE];
+    memset(masks, 0, (size_t)modulesCount);
+    if (row >= 0 && row < qr->size) {
+        raster_expand_bits(&qr->colors[row * qr->rowWords], qr->size, masks + quietZone);
+    }
+    if (options->format != OF_PBM) {
+        for (int32_t i = 0; i < modulesCount; i++) {
+            masks[i] = (uint8_t)~masks[i];
+        }
+    }
+    if (options->format == OF_PGM) {
+        raster_scale(masks, modulesCount, options->scale, scanline);
+    }
+    else {
+        uint8_t pixels[MAX_IMAGE_WIDTH];
+        raster_scale(masks, modulesCount, options->scale, pixels);
+        raster_pack_bits(pixels, modulesCount * options->scale, scanline);
+    }
+}
+
+internal void
+render_image(const QR *qr, const QRRenderOptions *options, RenderSink *sink)
+{
+    int32_t width = image_width(qr, options);
+    int32_t scanlineLen = scanline_len(options, width);
+
+    char header[MAX_HEADER_LEN];
+    int32_t headerLen = image_header(options, width, header);
+    memcpy(sink_reserve(sink, (size_t)headerLen), header, (size_t)headerLen);
+    sink->len += (size_t)headerLen;
+
+    uint8_t scanline[MAX_IMAGE_WIDTH];
+    for (int32_t row = -options->quietZone; row < qr->size + options->quietZone; row++) {
+        image_scanline(qr, options, row, scanline);
+        for (int32_t i = 0; i < options->scale; i++) {
+            memcpy(sink_reserve(sink, (size_t)scanlineLen), scanline, (size_t)scanlineLen);
+            sink->len += (size_t)scanlineLen;
+        }
+    }
+}
+
+global const uint8_t PNG_SIGNATURE[8] = {
+    137, 'P', 'N', 'G', '\r', '\n', 26, '\n',
+};
+
+internal void
+put_be32(uint8_t *bytes, uint32_t value)
+{
+    bytes[0] = (uint8_t)(value >> 24);
+    bytes[1] = (uint8_t)(value >> 16);
+    bytes[2] = (uint8_t)(value >> 8);
+    bytes[3] = (uint8_t)value;
+}
+
+internal void
+put_png_chunk(RenderSink *sink, const char *type, const uint8_t *data, int32_t dataLen)
+{
+    uint8_t *chunk = (uint8_t *)sink_reserve(sink, (size_t)dataLen + 12);
+    put_be32(chunk, (uint32_t)dataLen);
+    memcpy(chunk + 4, type, 4);
+    memcpy(chunk + 8, data, (size_t)dataLen);
+    put_be32(chunk + 8 + dataLen, png_crc32(0, chunk + 4, (size_t)dataLen + 4));
+    sink->len += (size_t)dataLen + 12;
+}
+
+internal void
+render_png(const QR *qr, const QRRenderOptions *options, RenderSink *sink)
+{
+    int32_t width = image_width(qr, options);
+    memcpy(sink_reserve(sink, sizeof(PNG_SIGNATURE)), PNG_SIGNATURE, sizeof(PNG_SIGNATURE));
+    sink->len += sizeof(PNG_SIGNATURE);
+
+    // 1-bit greyscale, deflate, no interlacing
+    uint8_t header[13] = {};
+    put_be32(header, (uint32_t)width);
+    put_be32(header + 4, (uint32_t)width);
+    header[8] = 1;
+    put_png_chunk(sink, "IHDR", header, sizeof(header));
+
+    // The stream is split into IDAT chunks as the staging buffer fills up.
+    PngDeflater deflater;
+    png_deflate_init(&deflater, options->format == OF_PNG_STORED, 1 + scanline_len(options, width));
+    uint8_t idat[PNG_IDAT_LEN];
+    int32_t idatLen = 0;
+    uint8_t scanline[PNG_MAX_ROW_LEN];
+    scanline[0] = 0; // no filter
+    int32_t lastRow = qr->size + options->quietZone - 1;
+    for (int32_t row = -options->quietZone; row <= lastRow; row++) {
+        image_scanline(qr, options, row, scanline + 1);
+        for (int32_t i = 0; i < options->scale; i++) {
+            if (idatLen + PNG_MAX_DEFLATE_ROW_LEN > PNG_IDAT_LEN) {
+                put_png_chunk(sink, "IDAT", idat, idatLen);
+                idatLen = 0;
+            }
+            bool isLast = (row == lastRow) && (i == options->scale - 1);
+            idatLen += png_deflate_row(&deflater, scanline, isLast, idat + idatLen);
+        }
+    }
+    put_png_chunk(sink, "IDAT", idat, idatLen);
+    put_png_chunk(sink, "IEND", NULL, 0);
+}
+
+// Dark modules (row, column) with column in [first, end) and the modules just outside are light.
+internal bool
+is_dark_run(const QR *qr, int32_t row, int32_t first, int32_t end)
+{
+    if (module_color(qr, row, first - 1) == MC_DARK || module_color(qr, row, end) == MC_DARK) {
+        return false;
+    }
+    for (int32_t column = first; column < end; column++) {
+        if (module_color(qr, row, column) == MC_LIGHT) {
+            return false;
+        }
+    }
+    return true;
+}
+
+internal int32_t
+put_number(char *out, int32_t number)
+{
+    char digits[12];
+    int32_t digitsCount = 0;
+    do {
+        digits[digitsCount++] = (char)('0' + number % 10);
+        number /= 10;
+    } while (number > 0);
+    for (int32_t i = 0; i < digitsCount; i++) {
+        out[i] = digits[digitsCount - 1 - i];
+    }
+    return digitsCount;
+}
+
+// A single path in module units, one subpath per rectangle of dark modules. Rectangles are horizontal
+// runs merged with the identical runs of the rows below.
+internal void
+render_svg(const QR *qr, const QRRenderOptions *options, RenderSink *sink)
+{
+    int32_t modulesCount = qr->size + 2 * options->quietZone;
+    int32_t width = modulesCount * options->scale;
+    const char *shapeRendering = (options->format == OF_SVG_CRISP) ? " shape-rendering=\"crispEdges\"" : "";
+    char *header = sink_reserve(sink, MAX_SVG_HEADER_LEN);
+    sink->len += (size_t)snprintf(header, MAX_SVG_HEADER_LEN,
+                                  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                                  "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" viewBox=\"0 0 %d %d\"%s>\n"
+                                  "<rect width=\"%d\" height=\"%d\" fill=\"#fff\"/>\n"
+                                  "<path fill=\"#000\" d=\"",
+                                  width, width, modulesCount, modulesCount, shapeRendering, modulesCount, modulesCount);
+
+    for (int32_t row = 0; row < qr->size; row++) {
+        for (int32_t column = 0; column < qr->size;) {
+            if (module_color(qr, row, column) == MC_LIGHT) {
+                column++;
+                continue;
+            }
+            int32_t end = column + 1;
+            while (end < qr->size && module_color(qr, row, end) == MC_DARK) {
+                end++;
+            }
+            // Rectangles start in the first row of their run.
+            if (row == 0 || !is_dark_run(qr, row - 1, column, end)) {
+                int32_t height = 1;
+                while (is_dark_run(qr, row + height, column, end)) {
+                    height++;
+                }
+                // "M" x "," y "h" w "v" h "h-" w "z"
+                char *subpath = sink_reserve(sink, 40);
+                char *subpathEnd = subpath;
+                *subpathEnd++ = 'M';
+                subpathEnd += put_number(subpathEnd, column + options->quietZone);
+                *subpathEnd++ = ',';
+                subpathEnd += put_number(subpathEnd, row + options->quietZone);
+                *subpathEnd++ = 'h';
+                subpathEnd += put_number(subpathEnd, end - column);
+                *subpathEnd++ = 'v';
+                subpathEnd += put_number(subpathEnd, height);
+                *subpathEnd++ = 'h';
+                *subpathEnd++ = '-';
+                subpathEnd += put_number(subpathEnd, end - column);
+                *subpathEnd++ = 'z';
+                sink->len += (size_t)(subpathEnd - subpath);
+            }
+            column = end;
+        }
+    }
+
+    const char footer[] = "\"/>\n</svg>\n";
+    memcpy(sink_reserve(sink, sizeof(footer) - 1), footer, sizeof(footer) - 1);
+    sink->len += sizeof(footer) - 1;
+}
+
+internal void
+render(const QR *qr, const QRRenderOptions *options, RenderSink *sink)
+{
+    switch (options->format) {
+        case OF_PBM:
+        case OF_PGM: render_image(qr, options, sink); break;
+        case OF_PNG:
+        case OF_PNG_STORED: render_png(qr, options, sink); break;
+        case OF_SVG:
+        case OF_SVG_CRISP: render_svg(qr, options, sink); break;
+        default: render_text(qr, options, sink); break;
+    }
+}
+
+// Compressed images and paths are only measured by rendering them, so they are rendered straight into buffer
+// and only counted from where they might overflow it.
+internal size_t
+render_bounded(const QR *qr, const QRRenderOptions *options, char *buffer, size_t bufferSize)
+{
+    char spill[RENDER_BUFFER_SIZE];
+    RenderSink sink = {.out = NULL, .isStreaming = true, .bytes = buffer, .len = 0, .cap = (buffer != NULL) ? bufferSize : 0,
+                       .spill = spill};
+    render(qr, options, &sink);
+    sink_flush(&sink);
+    return sink.flushedLen;
+}
+
+size_t
+qr_render(const QR *qr, const QRRenderOptions *options, char *buffer, size_t bufferSize)
+{
+    if (qr == NULL || options == NULL) {
+        return 0;
+    }
+    bool isValid = 0 <= options->format && options->format < OF_COUNT
+        && MIN_SCALE <= options->scale && options->scale <= MAX_SCALE
+        && 0 <= options->quietZone && options->quietZone <= MAX_QUIET_ZONE;
+    if (!isValid) {
+        return 0;
+    }
+
+    size_t size = 0;
+    switch (options->format) {
+        case OF_PBM:
+        case OF_PGM: size = image_size(qr, options); break;
+        case OF_PNG:
+        case OF_PNG_STORED:
+        case OF_SVG:
+        case OF_SVG_CRISP: return render_bounded(qr, options, buffer, bufferSize);
+        default: size = text_size(qr, options); break;
+    }
+    if (buffer == NULL || size > bufferSize) {
+        return size;
+    }
+
+    RenderSink sink = {.out = NULL, .isStreaming = false, .bytes = buffer, .len = 0, .cap = size};
+    render(qr, options, &sink);
+    ASSERT(sink.len == size);
+    return size;
+}
+
+void
+qr_print(FILE *out, const QR *qr, const QRRenderOptions *options)
+{
+    ASSERT(0 <= options->format && options->format < OF_COUNT);
+
+    // Output is buffered until the next line might not fit, so most symbols take a single write.
+    char buffer[RENDER_BUFFER_SIZE];
+    RenderSink sink = {.out = out, .isStreaming = true, .bytes = buffer, .len = 0, .cap = sizeof(buffer)};
+    render(qr, options, &sink);
+    fwrite(buffer, 1, sink.len, out);
+}
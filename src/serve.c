@@ -0,0 +1,305 @@
+// accept4, fopencookie and the SOCK_ flags of socket
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "serve.h"
+
+// The events are one-shot, so a connection belongs to the worker that took its event until the worker rearms it.
+// Its socket stays blocking: the worker reads only after an event and may block on writing a response, but only
+// for SERVE_SEND_TIMEOUT_SECONDS at a time, so a client that stops reading cannot hold the worker.
+typedef struct ServeConnection ServeConnection;
+struct ServeConnection
+{
+    _Atomic bool isUsed;
+    FILE *out; // owns the socket
+    int32_t fd;
+    bool isSendFailed; // set by the first send that fails or times out, closes the connection
+    int32_t inputLen;
+    uint8_t input[4 + SERVE_MAX_REQUEST_LEN];
+};
+
+typedef struct ServeServer ServeServer;
+struct ServeServer
+{
+    int32_t epollFd;
+    int32_t listenFd; // non-blocking, so accepting stops once the backlog is empty
+    QROptions *defaults;
+    QRCache *cache;
+};
+
+global ServeConnection SERVE_CONNECTIONS[SERVE_MAX_CONNECTIONS];
+
+internal uint32_t
+get_be32(const uint8_t *bytes)
+{
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+internal void
+put_be32(uint8_t *bytes, uint32_t value)
+{
+    bytes[0] = (uint8_t)(value >> 24);
+    bytes[1] = (uint8_t)(value >> 16);
+    bytes[2] = (uint8_t)(value >> 8);
+    bytes[3] = (uint8_t)value;
+}
+
+void
+serve_put_request_header(const QROptions *options, uint8_t *header)
+{
+    header[0] = (options->forcedLevel == LEVEL_INVALID) ? SERVE_AUTO : (uint8_t)options->forcedLevel;
+    header[1] = (options->forcedVersion == VERSION_INVALID) ? SERVE_AUTO : (uint8_t)(options->forcedVersion + 1);
+    header[2] = (options->forcedMask == MASK_INVALID) ? SERVE_AUTO : (uint8_t)options->forcedMask;
+    header[3] = (uint8_t)options->render.format;
+    header[4] = (uint8_t)options->render.scale;
+    header[5] = (uint8_t)options->render.quietZone;
+}
+
+// Leaves the range checks to qr_encode, except for version 0, which would read as VERSION_INVALID.
+internal QRStatus
+parse_request_header(const uint8_t *header, const QROptions *defaults, QROptions *options)
+{
+    *options = *defaults;
+    if (header[1] == 0) {
+        return QR_ERROR_INVALID_OPTIONS;
+    }
+    options->forcedLevel = (header[0] == SERVE_AUTO) ? LEVEL_INVALID : header[0];
+    options->forcedVersion = (header[1] == SERVE_AUTO) ? VERSION_INVALID : header[1] - 1;
+    options->forcedMask = (header[2] == SERVE_AUTO) ? MASK_INVALID : header[2];
+    options->render.format = header[3];
+    options->render.scale = header[4];
+    options->render.quietZone = header[5];
+    return QR_OK;
+}
+
+internal void
+arm(ServeServer *server, int32_t op, int32_t fd, ServeConnection *connection)
+{
+    struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = connection};
+    if (epoll_ctl(server->epollFd, op, fd, &event) != 0) {
+        fprintf(stderr, "Failed to watch socket: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+internal void
+close_connection(ServeConnection *connection)
+{
+    // Closing the socket also removes it from the epoll set.
+    fclose(connection->out);
+    atomic_store_explicit(&connection->isUsed, false, memory_order_release);
+}
+
+// A send that fails or times out fails every later one at once, instead of blocking the worker for another timeout
+// on each write of a streamed response. A blocking send only returns short when it times out.
+internal ssize_t
+send_bytes(void *cookie, const char *bytes, size_t len)
+{
+    ServeConnection *connection = cookie;
+    if (!connection->isSendFailed) {
+        ssize_t sentCount = send(connection->fd, bytes, len, 0);
+        connection->isSendFailed = (sentCount != (ssize_t)len);
+    }
+    return connection->isSendFailed ? -1 : (ssize_t)len;
+}
+
+internal int
+close_socket(void *cookie)
+{
+    ServeConnection *connection = cookie;
+    return close(connection->fd);
+}
+
+// Only the worker that took the event of the listening socket accepts, so the slots are claimed by one thread.
+internal void
+accept_connections(ServeServer *server)
+{
+    for (;;) {
+        int32_t fd = accept4(server->listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Failed to accept a connection: %s\n", strerror(errno));
+            }
+            break;
+        }
+        ServeConnection *connection = NULL;
+        for (int32_t i = 0; i < SERVE_MAX_CONNECTIONS && connection == NULL; i++) {
+            if (!atomic_load_explicit(&SERVE_CONNECTIONS[i].isUsed, memory_order_acquire)) {
+                connection = &SERVE_CONNECTIONS[i];
+            }
+        }
+        struct timeval sendTimeout = {.tv_sec = SERVE_SEND_TIMEOUT_SECONDS};
+        if (connection == NULL || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout)) != 0) {
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->isSendFailed = false;
+        connection->inputLen = 0;
+        connection->out = fopencookie(connection, "w", (cookie_io_functions_t){.write = send_bytes, .close = close_socket});
+        if (connection->out == NULL) {
+            close(fd);
+            continue;
+        }
+        atomic_store_explicit(&connection->isUsed, true, memory_order_relaxed);
+        arm(server, EPOLL_CTL_ADD, fd, connection);
+    }
+    arm(server, EPOLL_CTL_MOD, server->listenFd, NULL);
+}
+
+// Renders into buffer unless the response does not fit, then streams it from qr.
+internal void
+respond(ServeConnection *connection, QRStatus status, const QR *qr, const QRRenderOptions *render, const char *buffer,
+        size_t size)
+{
+    uint8_t header[4 + SERVE_RESPONSE_HEADER_LEN];
+    put_be32(header, (uint32_t)(SERVE_RESPONSE_HEADER_LEN + size));
+    header[4] = (uint8_t)status;
+    fwrite(header, 1, sizeof(header), connection->out);
+    if (size <= SERVE_RESPONSE_BUFFER_SIZE) {
+        fwrite(buffer, 1, size, connection->out);
+    }
+    else {
+        qr_print(connection->out, qr, render);
+    }
+}
+
+// Answers every complete request read so far and flushes the answers together.
+internal void
+serve_connection(ServeServer *server, ServeConnection *connection, QRWorkspace *workspace, char *buffer)
+{
+    ssize_t readCount = recv(connection->fd, connection->input + connection->inputLen,
+                             sizeof(connection->input) - (size_t)connection->inputLen, 0);
+    if (readCount < 0 && errno == EINTR) {
+        arm(server, EPOLL_CTL_MOD, connection->fd, connection);
+        return;
+    }
+    if (readCount <= 0) {
+        close_connection(connection);
+        return;
+    }
+    connection->inputLen += (int32_t)readCount;
+
+    bool isBroken = false;
+    int32_t start = 0;
+    while (!connection->isSendFailed && connection->inputLen - start >= 4) {
+        uint32_t length = get_be32(connection->input + start);
+        if (length < SERVE_REQUEST_HEADER_LEN || length > SERVE_MAX_REQUEST_LEN) {
+            // The stream cannot be followed past a broken length.
+            QRStatus status = (length < SERVE_REQUEST_HEADER_LEN) ? QR_ERROR_INVALID_OPTIONS : QR_ERROR_TEXT_TOO_LONG;
+            respond(connection, status, NULL, NULL, buffer, 0);
+            isBroken = true;
+            break;
+        }
+        if (connection->inputLen - start < 4 + (int32_t)length) {
+            break;
+        }
+        const uint8_t *request = connection->input + start + 4;
+        QROptions options;
+        QR qr;
+        size_t size = 0;
+        QRStatus status = parse_request_header(request, server->defaults, &options);
+        if (status == QR_OK) {
+            const char *text = (const char *)request + SERVE_REQUEST_HEADER_LEN;
+            status = qr_cache_encode_rendered(server->cache, text, (int32_t)length - SERVE_REQUEST_HEADER_LEN, &options,
+                                              workspace, &qr, buffer, SERVE_RESPONSE_BUFFER_SIZE, &size);
+        }
+        respond(connection, status, &qr, &options.render, buffer, size);
+        start += 4 + (int32_t)length;
+    }
+    memmove(connection->input, connection->input + start, (size_t)(connection->inputLen - start));
+    connection->inputLen -= start;
+
+    if (fflush(connection->out) != 0 || connection->isSendFailed || isBroken) {
+        close_connection(connection);
+        return;
+    }
+    arm(server, EPOLL_CTL_MOD, connection->fd, connection);
+}
+
+internal void *
+serve_connections(void *arg)
+{
+    ServeServer *server = arg;
+    QRWorkspace workspace;
+    char buffer[SERVE_RESPONSE_BUFFER_SIZE];
+    for (;;) {
+        // One event at a time, so the ready connections spread over the idle workers.
+        struct epoll_event event;
+        if (epoll_wait(server->epollFd, &event, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to wait for sockets: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (event.data.ptr == NULL) {
+            accept_connections(server);
+        }
+        else {
+            serve_connection(server, event.data.ptr, &workspace, buffer);
+        }
+    }
+}
+
+void
+serve_run(QROptions *defaults, ServeOptions *serve)
+{
+    // Writes to closed connections fail with EPIPE instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(serve->socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path exceeds the maximum length of %zu characters\n", sizeof(address.sun_path) - 1);
+        exit(1);
+    }
+    strcpy(address.sun_path, serve->socketPath);
+
+    // Replace the socket left by a previous server, but nothing else.
+    struct stat socketStat;
+    if (stat(serve->socketPath, &socketStat) == 0 && S_ISSOCK(socketStat.st_mode)) {
+        unlink(serve->socketPath);
+    }
+
+    ServeServer server = {.defaults = defaults, .cache = serve->cache};
+    server.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server.listenFd < 0 || bind(server.listenFd, (struct sockaddr *)&address, sizeof(address)) != 0
+        || listen(server.listenFd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Failed to listen on socket '%s': %s\n", serve->socketPath, strerror(errno));
+        exit(1);
+    }
+    server.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.epollFd < 0) {
+        fprintf(stderr, "Failed to create epoll instance: %s\n", strerror(errno));
+        exit(1);
+    }
+    arm(&server, EPOLL_CTL_ADD, server.listenFd, NULL);
+
+    // The calling thread is one of the workers.
+    for (int32_t i = 1; i < serve->jobsCount; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, serve_connections, &server) != 0) {
+            fprintf(stderr, "Failed to start server worker %d\n", i);
+            exit(1);
+        }
+    }
+    serve_connections(&server);
+    UNREACHABLE();
+}
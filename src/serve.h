@@ -0,0 +1,35 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdint.h>
+
+#include "qr.h"
+
+// Requests and responses start with the length of the rest as a 32-bit big-endian integer, as LENGTH records do.
+// A request continues with SERVE_REQUEST_HEADER_LEN option bytes and the text to encode. The options are the
+// level (0 to 3), the version (1 to 40) and the mask (0 to 7), each SERVE_AUTO when not forced, then the
+// OutputFormat, the scale and the quiet zone.
+// A response continues with a QRStatus byte and, for QR_OK, the rendered symbol.
+#define SERVE_AUTO 0xFF
+#define SERVE_REQUEST_HEADER_LEN 6
+#define SERVE_MAX_REQUEST_LEN (SERVE_REQUEST_HEADER_LEN + MAX_TEXT_LEN)
+#define SERVE_RESPONSE_HEADER_LEN 1
+#define SERVE_MAX_CONNECTIONS 256
+#define SERVE_RESPONSE_BUFFER_SIZE (1 << 20) // responses that do not fit are streamed
+#define SERVE_SEND_TIMEOUT_SECONDS 5 // clients that take no response bytes for longer are disconnected
+
+typedef struct ServeOptions ServeOptions;
+struct ServeOptions
+{
+    bool isEnabled;
+    char *socketPath;
+    int32_t jobsCount; // threads that serve the connections
+    QRCache *cache;    // of the symbols and their renderings, NULL encodes every request
+};
+
+// Packs the options of a request into header.
+void serve_put_request_header(const QROptions *options, uint8_t *header);
+// Serves requests on a Unix domain socket until the process is killed. Requests take the mask search from defaults.
+__attribute__((noreturn)) void serve_run(QROptions *defaults, ServeOptions *serve);
+
+#endif //SERVE_H
@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "qr.h"
+#include "batch.h"
+#include "serve.h"
+
+// Test client of qr -S. Sends every line of STDIN as a request, where lines start with their options and a tab
+// as with qr -b LINE -p, and prints the responses as qr does, separated by a newline.
+
+#define CLIENT_CONNECT_ATTEMPTS 100 // 10 ms apart, to wait for a server that is starting
+
+global BatchReader READER;
+global char RESPONSE_BUFFER[1 << 16];
+
+internal void
+write_all(int32_t fd, const void *bytes, size_t len)
+{
+    for (size_t written = 0; written < len;) {
+        ssize_t writeCount = write(fd, (const char *)bytes + written, len - written);
+        if (writeCount < 0 && errno == EINTR) {
+            continue;
+        }
+        if (writeCount <= 0) {
+            fprintf(stderr, "Failed to send a request: %s\n", strerror(errno));
+            exit(1);
+        }
+        written += (size_t)writeCount;
+    }
+}
+
+internal void
+read_all(int32_t fd, void *bytes, size_t len)
+{
+    for (size_t readLen = 0; readLen < len;) {
+        ssize_t readCount = read(fd, (char *)bytes + readLen, len - readLen);
+        if (readCount < 0 && errno == EINTR) {
+            continue;
+        }
+        if (readCount <= 0) {
+            fprintf(stderr, "Failed to receive a response: %s\n", (readCount == 0) ? "connection closed" : strerror(errno));
+            exit(1);
+        }
+        readLen += (size_t)readCount;
+    }
+}
+
+internal int32_t
+connect_to_server(char *socketPath)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path exceeds the maximum length of %zu characters\n", sizeof(address.sun_path) - 1);
+        exit(1);
+    }
+    strcpy(address.sun_path, socketPath);
+    for (int32_t attempt = 1;; attempt++) {
+        int32_t fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+            exit(1);
+        }
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+            return fd;
+        }
+        bool isStarting = errno == ENOENT || errno == ECONNREFUSED;
+        if (!isStarting || attempt == CLIENT_CONNECT_ATTEMPTS) {
+            fprintf(stderr, "Failed to connect to socket '%s': %s\n", socketPath, strerror(errno));
+            exit(1);
+        }
+        close(fd);
+        nanosleep(&(struct timespec){.tv_nsec = 10 * 1000 * 1000}, NULL);
+    }
+}
+
+int32_t
+main(int32_t argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s SOCKET FORMAT\n", argv[0]);
+        return 1;
+    }
+    QROptions defaults = {};
+    defaults.forcedLevel = LEVEL_INVALID;
+    defaults.forcedVersion = VERSION_INVALID;
+    defaults.forcedMask = MASK_INVALID;
+    defaults.render.format = 0;
+    while (defaults.render.format < OF_COUNT && strcmp(argv[2], OutputFormatNames[defaults.render.format]) != 0) {
+        defaults.render.format++;
+    }
+    if (defaults.render.format == OF_COUNT) {
+        fprintf(stderr, "Invalid output format: %s\n", argv[2]);
+        return 1;
+    }
+    defaults.render.scale = MIN_SCALE;
+    defaults.render.quietZone = DEFAULT_QUIET_ZONE;
+
+    int32_t fd = connect_to_server(argv[1]);
+    batch_reader_init(&READER, stdin, BF_LINE);
+    char *record = NULL;
+    int32_t recordLen = 0;
+    while (batch_read_record(&READER, &record, &recordLen)) {
+        int64_t recordIndex = READER.recordsCount - 1;
+        QROptions options = defaults;
+        char *text = NULL;
+        int32_t textLen = 0;
+        batch_parse_record(record, recordLen, true, recordIndex, &options, &text, &textLen);
+
+        uint8_t header[4 + SERVE_REQUEST_HEADER_LEN];
+        uint32_t length = (uint32_t)(SERVE_REQUEST_HEADER_LEN + textLen);
+        header[0] = (uint8_t)(length >> 24);
+        header[1] = (uint8_t)(length >> 16);
+        header[2] = (uint8_t)(length >> 8);
+        header[3] = (uint8_t)length;
+        serve_put_request_header(&options, header + 4);
+        write_all(fd, header, sizeof(header));
+        write_all(fd, text, (size_t)textLen);
+
+        uint8_t responseHeader[4 + SERVE_RESPONSE_HEADER_LEN];
+        read_all(fd, responseHeader, sizeof(responseHeader));
+        QRStatus status = responseHeader[4];
+        if (status != QR_OK) {
+            fprintf(stderr, "Failed to encode record %" PRId64 ": %s\n", recordIndex, qr_status_message(status));
+            return 1;
+        }
+        if (recordIndex > 0) {
+            fputc('\n', stdout);
+        }
+        size_t remainingLen = (((size_t)responseHeader[0] << 24) | ((size_t)responseHeader[1] << 16)
+                               | ((size_t)responseHeader[2] << 8) | responseHeader[3]) - SERVE_RESPONSE_HEADER_LEN;
+        while (remainingLen > 0) {
+            size_t chunkLen = MIN(remainingLen, sizeof(RESPONSE_BUFFER));
+            read_all(fd, RESPONSE_BUFFER, chunkLen);
+            fwrite(RESPONSE_BUFFER, 1, chunkLen, stdout);
+            remainingLen -= chunkLen;
+        }
+    }
+    close(fd);
+    return 0;
+}